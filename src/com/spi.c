@@ -46,4 +46,78 @@ void spi_get_default_config(spi_config_t *config) {
     config->clock_rate = SPI_CLOCK_RATE_FOSC_4;
 }
 
+void spi_read_block(uint8_t *buffer, uint16_t length) {
+    uint8_t data;
+
+    // Nothing to read
+    if (length == 0) {
+        return;
+    }
+
+    // Start the first transfer
+    SPDR = 0x00;
+    length--;
+
+    // Move an odd byte first, the loop below moves two bytes per pass
+    if (length & 0x01) {
+        SPI_WAIT();
+        data = SPDR;
+        SPDR = 0x00;
+        *buffer++ = data;
+    }
+    length >>= 1;
+
+    // Start the next transfer before storing the received byte
+    while (length) {
+        length--;
+        SPI_WAIT();
+        data = SPDR;
+        SPDR = 0x00;
+        *buffer++ = data;
+        SPI_WAIT();
+        data = SPDR;
+        SPDR = 0x00;
+        *buffer++ = data;
+    }
+
+    // Store the last byte
+    SPI_WAIT();
+    *buffer = SPDR;
+}
+
+void spi_write_block(uint8_t *buffer, uint16_t length) {
+    uint8_t data;
+
+    // Nothing to write
+    if (length == 0) {
+        return;
+    }
+
+    // Start the first transfer
+    SPDR = *buffer++;
+    length--;
+
+    // Move an odd byte first, the loop below moves two bytes per pass
+    if (length & 0x01) {
+        data = *buffer++;
+        SPI_WAIT();
+        SPDR = data;
+    }
+    length >>= 1;
+
+    // Load the next byte while the current one is shifted out
+    while (length) {
+        length--;
+        data = *buffer++;
+        SPI_WAIT();
+        SPDR = data;
+        data = *buffer++;
+        SPI_WAIT();
+        SPDR = data;
+    }
+
+    // Wait for the last byte
+    SPI_WAIT();
+}
+
 #endif // COM_SPI
@@ -129,5 +129,30 @@ extern void spi_get_default_config(spi_config_t *config);
  */
 #define SPI_WAIT() while(!(SPSR&(1<<SPIF)))
 
+/**
+ * @brief Read a block of bytes from the SPI channel
+ *
+ * Clocks out dummy bytes and stores every received byte in _buffer_. The next
+ * transfer is started before the received byte is stored, so the shifter is not
+ * idle while the byte is moved to memory.
+ *
+ * @note Chip select should be handled by the caller
+ * @param buffer Buffer to store the received bytes in
+ * @param length Number of bytes to read
+ */
+extern void spi_read_block(uint8_t *buffer, uint16_t length);
+
+/**
+ * @brief Write a block of bytes to the SPI channel
+ *
+ * The next byte is loaded from memory while the current byte is being shifted
+ * out, so a new transfer can start as soon as the previous one finished.
+ *
+ * @note Chip select should be handled by the caller
+ * @param buffer Buffer with the bytes to write
+ * @param length Number of bytes to write
+ */
+extern void spi_write_block(uint8_t *buffer, uint16_t length);
+
 #endif // COM_SPI
 #endif // COM_SPI_H
@@ -77,6 +77,108 @@
  * @brief Enable network
  */
 #define NET_NETWORK
+/**
+ * @brief Run the SPI bus to the network chip at double speed (F_CPU / 2).
+ * At 20 MHz this clocks the chip at 10 MHz, well within its 20 MHz limit and
+ * above the 8 MHz its errata asks for when reading MAC and MII registers.
+ */
+#define NET_NETWORK_SPI_DOUBLE_SPEED
+/**
+ * @brief Count SPI transactions with the network chip, in total and for the
+ * last received packet
+ */
+//#define NET_NETWORK_SPI_STATS
+/**
+ * @brief Only read the headers of received packets into buffer_in
+ *
+ * The rest of the packet stays in the network chip and is read on demand by
+ * network_fetch() or network_read(). Unhandled packets hardly cost any SPI
+ * time and BUFFER_IN_SIZE can be lowered to what your handlers need. UDP and
+ * TCP packets are still loaded to verify their checksums, and dropped when
+ * they do not fit in BUFFER_IN_SIZE.
+ */
+//#define NET_NETWORK_LAZY_RECEIVE
+/**
+ * @brief Let the DMA of the network chip calculate UDP and TCP checksums
+ *
+ * Packets are loaded into the network chip before the checksum is calculated,
+ * only the two checksum bytes are written afterwards. Without it checksums are
+ * calculated in software. Receiving is paused while the DMA calculates a
+ * checksum, as the silicon errata require for all revisions, so packets
+ * arriving meanwhile can be lost.
+ */
+//#define NET_NETWORK_CHECKSUM_OFFLOAD
+/**
+ * @brief Number of packets the transmit buffer of the network chip can queue
+ *
+ * Each slot takes 1.5 KB of the 8 KB buffer memory of the network chip, the
+ * receive buffer gets the rest. Between 1 and 4 slots.
+ */
+#define NET_NETWORK_TX_SLOTS 2
+/**
+ * @brief Receive packets on the interrupt pin of the network chip
+ *
+ * The INT pin of the network chip should be connected to INT2 (PB2). The
+ * network chip is only asked for packets when it pulls the pin low, so an idle
+ * network costs little SPI traffic and network_idle() can sleep the CPU. The
+ * packet count is still read once a second (every 256 calls without
+ * UTILS_COUNTER), as the pin can miss packets.
+ */
+//#define NET_NETWORK_INTERRUPT
+/**
+ * @brief Measure the time between the interrupt of a packet and reading it
+ *
+ * Requires NET_NETWORK_INTERRUPT and timer 1 running. With
+ * UTILS_COUNTER_TIMER1 the latency is measured in steps of 3.2 us up to about
+ * 210 ms, longer latencies read as the maximum.
+ */
+//#define NET_NETWORK_INTERRUPT_LATENCY
+/**
+ * @brief Receive multicast packets of joined addresses
+ *
+ * Enables the hash table filter of the network chip, addresses are joined
+ * with network_multicast_join().
+ */
+//#define NET_NETWORK_MULTICAST
+/**
+ * @brief Run the network chip in full-duplex
+ *
+ * The network chip does not auto-negotiate, only enable this when the switch
+ * port is set to full-duplex as well. Otherwise it falls back to half-duplex
+ * and the duplex mismatch causes lost packets. The mode can also be changed
+ * with network_set_duplex().
+ */
+//#define NET_NETWORK_FULL_DUPLEX
+/**
+ * @brief Number of callbacks which can be registered for link changes
+ */
+#define NET_NETWORK_LINK_LISTENERS 2
+/**
+ * @brief Use buffer_in for transmitting as well
+ *
+ * Saves BUFFER_OUT_SIZE bytes of RAM. Replies are built in place over the
+ * received packet, so a service should read what it needs from the received
+ * packet before preparing a reply. Packets sent without a request overwrite
+ * the last received packet.
+ */
+//#define NET_NETWORK_SHARED_BUFFER
+/**
+ * @brief Receive packets in a pool of buffers
+ *
+ * Packets can be held in their buffer after they are handled, so a service
+ * can wait for something without losing the packet. Every buffer takes
+ * BUFFER_IN_SIZE bytes of RAM, lower BUFFER_IN_SIZE when enabling. Can not be
+ * combined with NET_NETWORK_SHARED_BUFFER or NET_NETWORK_LAZY_RECEIVE.
+ */
+//#define NET_NETWORK_POOL
+/**
+ * @brief Number of buffers in the pool, between 2 and 8
+ */
+#define NET_NETWORK_POOL_SIZE 3
+/**
+ * @brief Do not verify the IP header checksum of received packets
+ */
+//#define NET_IP_SKIP_CHECKSUM
 /**
  * @brief Network buffer in size
  */
@@ -100,6 +202,54 @@
  */
 #define NET_ARP_CACHE_SIZE 10
 
+/**
+ * @brief Seconds an unused ARP cache entry is kept
+ *
+ * Entries in use are requested again after this time and forgotten when the
+ * address does not answer.
+ */
+#define NET_ARP_TTL 300
+
+/**
+ * @brief Number of destinations remembered with the MAC address to send to
+ */
+#define NET_IP_DESTINATIONS 4
+
+/**
+ * @brief Learn addresses from received packets
+ *
+ * Senders of IP packets on the own subnet and of ARP requests for the own
+ * address are added to the cache, other overheard requests refresh it.
+ */
+//#define NET_ARP_SNOOP
+
+/**
+ * @brief Number of addresses which can be resolved at the same time
+ */
+#define NET_ARP_PENDING_SIZE 2
+
+/**
+ * @brief Largest packet kept per address while it is being resolved
+ *
+ * Takes NET_ARP_PENDING_SIZE times this many bytes of RAM. Holds werkti reports
+ * and TCP SYN packets, larger packets need NET_NETWORK_POOL.
+ */
+#define NET_ARP_PARK_SIZE 96
+
+/**
+ * @brief Number of packets per address kept in pool buffers while it is being
+ * resolved, in addition to the one of NET_ARP_PARK_SIZE, requires
+ * NET_NETWORK_POOL
+ */
+#define NET_ARP_PENDING_PACKETS 2
+
+/**
+ * @brief Number of requests sent before giving up on an address
+ *
+ * Requests are retried after 1, 2, 4, ... seconds.
+ */
+#define NET_ARP_RETRIES 4
+
 //
 // Dynamic Host Configuration Protocol (DHCP)
 // --------------------------------------------------------------------
@@ -128,6 +278,29 @@
  */
 #define NET_ICMP
 
+/**
+ * @brief Let the network chip copy ping requests into the reply
+ *
+ * The DMA of the network chip copies the received packet to the transmit
+ * buffer, only the changed addresses, type and checksum are written over SPI.
+ * Pings larger than BUFFER_OUT_SIZE can be answered as well.
+ */
+#define NET_ICMP_ZERO_COPY
+
+//
+// Internet Group Management Protocol (IGMP)
+// --------------------------------------------------------------------
+
+/**
+ * @brief IGMP enable, requires NET_NETWORK_MULTICAST and UTILS_COUNTER
+ */
+//#define NET_IGMP
+
+/**
+ * @brief Number of multicast groups which can be joined
+ */
+#define NET_IGMP_GROUPS 4
+
 //
 // User Datagram Protocol (UDP)
 // --------------------------------------------------------------------
@@ -147,6 +320,14 @@
  */
 #define NET_UDP_SERVICES_LIST_SIZE 10
 
+/**
+ * @brief Do not verify the checksum of received UDP packets
+ *
+ * With NET_NETWORK_LAZY_RECEIVE this also saves loading the data of packets
+ * nobody listens to.
+ */
+//#define NET_UDP_SKIP_CHECKSUM
+
 //
 // Transmission Control Protocol (TCP)
 // --------------------------------------------------------------------
@@ -166,6 +347,72 @@
  */
 #define NET_TCP_SERVICES_LIST_SIZE 10
 
+/**
+ * @brief Number of connections which can be open at the same time
+ */
+#define NET_TCP_CONNECTIONS 4
+
+/**
+ * @brief Seconds after which a connection without traffic is dropped
+ *
+ * Frees the connections of peers which went silent, in any state. Requires
+ * UTILS_COUNTER. Connections waiting for a retransmission are left to
+ * NET_TCP_RETRIES.
+ */
+#define NET_TCP_IDLE_TIMEOUT 60
+
+/**
+ * @brief Milliseconds to wait for a reply to carry the acknowledgement
+ *
+ * Received data is acknowledged along with the reply of the service. When it
+ * does not reply, a separate ACK is sent after this delay or when the next
+ * packet arrives. Requires UTILS_COUNTER, comment out to acknowledge right
+ * after the service.
+ */
+#define NET_TCP_ACK_DELAY 200
+
+/**
+ * @brief Send unacknowledged TCP packets again
+ *
+ * SYN and FIN packets and data sent with tcp_stream() are sent again when no
+ * acknowledgement comes within the retransmission timeout. The timeout
+ * follows the measured round trip time. A stream waiting for a closed window
+ * probes it on the same timer. Requires UTILS_COUNTER.
+ */
+#define NET_TCP_RETRANSMIT
+
+/**
+ * @brief Retransmission timeout in milliseconds before a round trip is
+ * measured
+ */
+#define NET_TCP_RTO_INITIAL 1000
+
+/**
+ * @brief Smallest retransmission timeout in milliseconds
+ *
+ * RFC 6298 asks for at least one second, a smaller value sends packets again
+ * which were only delayed.
+ */
+#define NET_TCP_RTO_MIN 1000
+
+/**
+ * @brief Largest retransmission timeout in milliseconds
+ */
+#define NET_TCP_RTO_MAX 60000
+
+/**
+ * @brief Number of retransmissions before a connection is dropped
+ */
+#define NET_TCP_RETRIES 6
+
+/**
+ * @brief Do not verify the checksum of received TCP packets
+ *
+ * With NET_NETWORK_LAZY_RECEIVE this also saves loading the data of packets
+ * nobody listens to.
+ */
+//#define NET_TCP_SKIP_CHECKSUM
+
 
 /**********************************************************************
  * Utilities
@@ -238,9 +485,10 @@
 
 /**
  * @brief Werkti remote server mac address
- * @note Define as  0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+ * @note Define as  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, leave it out to route
+ * the reports with NET_ARP
  */
-#define WERKTI_REMOTE_MAC 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+//#define WERKTI_REMOTE_MAC 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 
 /**
  * @brief Werkti remote server ip address
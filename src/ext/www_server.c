@@ -39,6 +39,8 @@ typedef struct {
   const char *path;
   // Callback function
   void (*callback)(uint8_t type, uint8_t *data);
+  // Is the reply streamed?
+  uint8_t stream;
 } path_service_t;
 
 path_service_t path_services[EXT_WWW_SERVER_SERVICES_LIST_SIZE];
@@ -80,6 +82,7 @@ uint8_t path_matches_p(const char *str1, const char *str2) {
 }
 
 void path_service_remove(const char *path);
+void path_service_set(const char *path, void (*callback)(uint8_t type, uint8_t *data), uint8_t stream);
 void (*path_service_get(uint8_t *path, uint8_t length))(uint8_t type, uint8_t *data);
 // Path service
 
@@ -92,16 +95,25 @@ void www_server_init(void) {
   for (i = 0; i < EXT_WWW_SERVER_SERVICES_LIST_SIZE; i++) {
     path_services[i].path = 0;
     path_services[i].callback = 0;
+    path_services[i].stream = 0;
   }
 }
 
 void www_server_register_path(const char *path, void (*callback)(uint8_t type, uint8_t *data)) {
-  // path_service_set(path, callback);
+  path_service_set(path, callback, 0);
+}
+
+void www_server_register_stream(const char *path, void (*callback)(uint8_t type, uint8_t *data)) {
+  path_service_set(path, callback, 1);
+}
+
+void path_service_set(const char *path, void (*callback)(uint8_t type, uint8_t *data), uint8_t stream) {
   uint8_t i;
   for (i = 0; i < EXT_WWW_SERVER_SERVICES_LIST_SIZE; i++) {
     if (path_services[i].path == 0) {
       path_services[i].path = path;
       path_services[i].callback = callback;
+      path_services[i].stream = stream;
       return;
     }
   }
@@ -124,8 +136,17 @@ void www_server_unregister_path(const char *path) {
 const char newline[]   PROGMEM = "\r\n";
 const char not_found[] PROGMEM = "Not found";
 
-uint8_t *rbuffer;
-uint16_t rlength;
+// Path service index of a request without a service
+#define WWW_SERVICE_NONE 0xFF
+
+// Request being answered, zero when the reply is generated again
+uint8_t *reply_request;
+// Part of the reply to append: bytes to skip and bytes left
+uint32_t reply_skip;
+uint16_t reply_room;
+
+void reply_produce(uint16_t ref, uint32_t offset, uint16_t length);
+uint16_t reply_window(uint16_t *length);
 
 void handle_request(uint8_t *data, uint16_t length) {
   debug_string_p(PSTR("HTTP: "));
@@ -161,34 +182,73 @@ void handle_request(uint8_t *data, uint16_t length) {
   // Get callback for type/path combination
   // path_services_get(&data[path_start]);
   uint8_t i;
-  void (*callback)(uint8_t, uint8_t *);
 
-  for (i = 0, callback = 0; i < EXT_WWW_SERVER_SERVICES_LIST_SIZE; i++) {
+  for (i = 0; i < EXT_WWW_SERVER_SERVICES_LIST_SIZE; i++) {
     if (path_services[i].path && path_matches(&data[path_start], path_services[i].path)) {
-      callback = path_services[i].callback;
       break;
     }
   }
+  if (i == EXT_WWW_SERVER_SERVICES_LIST_SIZE) {
+    i = WWW_SERVICE_NONE;
+  }
+
+  if (i == WWW_SERVICE_NONE || path_services[i].stream) {
+    // Reply is streamed, the request is acknowledged by the connection
+    reply_request = data;
+    tcp_stream(reply_produce, ((uint16_t)type << 8) | i);
+    reply_request = 0;
+  } else {
+    // Reply in a single packet, the service is called once
+    tcp_prepare_reply();
+    tcp_add_flags(TCP_FLAG_ACK | TCP_FLAG_PUSH | TCP_FLAG_FIN);
+    tcp_gather_begin();
+    reply_skip = 0;
+    reply_room = tcp_current->mss;
+    path_services[i].callback(type, data);
+    tcp_gather_send();
+  }
+
+  debug_ok();
+}
+
+// Generate the reply and append the part of the window
+void reply_produce(uint16_t ref, uint32_t offset, uint16_t length) {
+  uint8_t i = ref & 0xFF;
 
-  // Prepare tcp reply
-  rbuffer = tcp_prepare_reply();
-  rlength = 0;
-  // Increase ack with length
-  add_value_to_buffer(length, &buffer_out[TCP_PTR_ACK_NR], 4);
-  // Set ACK flag
-  tcp_add_flags(TCP_FLAG_ACK | TCP_FLAG_PUSH | TCP_FLAG_FIN);
+  reply_skip = offset;
+  reply_room = length;
 
   // Check if we can handle the request
-  if (callback) {
-    callback(type, data);
+  if (i != WWW_SERVICE_NONE && path_services[i].callback) {
+    path_services[i].callback(ref >> 8, reply_request);
   } else {
     // Return 404, not found
     www_server_reply_header(HTTP_STATUS_404, HTTP_CONTENT_TYPE_PLAIN);
     www_server_reply_add_p(not_found);
     www_server_reply_send();
   }
+}
 
-  debug_ok();
+// Fit a piece of the reply in the window, returns the bytes to skip
+uint16_t reply_window(uint16_t *length) {
+  uint16_t skip;
+
+  // Piece is before the window
+  if (reply_skip >= *length) {
+    reply_skip -= *length;
+    *length = 0;
+    return 0;
+  }
+  skip = reply_skip;
+  reply_skip = 0;
+  *length -= skip;
+
+  // Piece is cut off at the end of the window
+  if (*length > reply_room) {
+    *length = reply_room;
+  }
+  reply_room -= *length;
+  return skip;
 }
 
 const char http_version[] PROGMEM = "HTTP/1.1 ";
@@ -235,11 +295,9 @@ void www_server_reply_header(uint8_t status, uint8_t content_type) {
 }
 
 void www_server_reply_send() {
-  // Make sure a packet ends with two newlines to mark end of data
+  // Make sure a reply ends with two newlines to mark end of data
   www_server_reply_add_p(newline);
   www_server_reply_add_p(newline);
-  // Send packet
-  tcp_send(rlength);
 }
 
 void www_server_reply_add(char *data) {
@@ -247,17 +305,23 @@ void www_server_reply_add(char *data) {
 }
 
 void www_server_reply_add_n(char *data, uint16_t length) {
-  while(*data && length--) {
-    *rbuffer++ = *data++;
-    rlength++;
+  uint16_t n = 0;
+  // Length up to the end of the string
+  while (n < length && data[n]) {
+    n++;
+  }
+  data += reply_window(&n);
+  if (n) {
+    network_tx_append((uint8_t *)data, n);
   }
 }
 
 void www_server_reply_add_p(const char *pdata) {
-  char c;
-  while ((c = pgm_read_byte(pdata++))) {
-    *rbuffer++ = c;
-    rlength++;
+  uint16_t n = strlen_P(pdata);
+
+  pdata += reply_window(&n);
+  if (n) {
+    network_tx_append_p(pdata, n);
   }
 }
 
@@ -46,9 +46,25 @@ extern void www_server_init(void);
 
 /**
  * @brief Register callback method on a path
+ *
+ * The callback is called once with the request in <i>data</i> and writes the
+ * reply with the www_server_reply functions. The reply is sent in a single
+ * packet, it is cut off at the segment size of the peer. It is not sent again
+ * when it gets lost, the connection is reset instead. Use
+ * www_server_register_stream() for replies which can be generated again.
  */
 extern void www_server_register_path(const char *path, void (*callback)(uint8_t type, uint8_t *data));
 
+/**
+ * @brief Register callback method on a path with a streamed reply
+ *
+ * The reply can be larger than a packet. It is sent in parts and the callback
+ * is called again for every part, also for parts which are sent again. It
+ * should write the same reply every time and do nothing else. <i>data</i>
+ * holds the request on the first call only and is zero on the next calls.
+ */
+extern void www_server_register_stream(const char *path, void (*callback)(uint8_t type, uint8_t *data));
+
 /**
  * @brief Unregister callback method on a path
  */
@@ -60,7 +76,7 @@ extern void www_server_unregister_path(const char *path);
 extern void www_server_reply_header(uint8_t status, uint8_t content_type);
 
 /**
- * @brief Send http request reply
+ * @brief End the http request reply, the connection is closed when it is sent
  */
 extern void www_server_reply_send();
 
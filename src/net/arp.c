@@ -16,6 +16,18 @@
 #ifndef NET_ARP_CACHE_SIZE
 #error ARP cannot function without NET_ARP_CACHE_SIZE defined
 #endif // NET_ARP_CACHE_SIZE
+#ifndef NET_ARP_TTL
+#error ARP cannot function without NET_ARP_TTL defined
+#endif // NET_ARP_TTL
+#ifndef NET_ARP_PENDING_SIZE
+#error ARP cannot function without NET_ARP_PENDING_SIZE defined
+#endif // NET_ARP_PENDING_SIZE
+#ifndef NET_ARP_PARK_SIZE
+#error ARP cannot function without NET_ARP_PARK_SIZE defined
+#endif // NET_ARP_PARK_SIZE
+#ifndef UTILS_COUNTER
+#error ARP needs UTILS_COUNTER to retry requests
+#endif // UTILS_COUNTER
 
 // Types
 // -----
@@ -24,17 +36,48 @@
 typedef struct {
     uint8_t ip[4];
     uint8_t mac[6];
+    // ARP_ITEM_FREE, ARP_ITEM_USED or ARP_ITEM_DELETED
+    uint8_t state;
+    // Second of the last use, for aging and replacement
+    uint16_t used;
+    // Second of the last reply from the address
+    uint16_t confirmed;
 } arp_item_t;
 
+// Slot never used, ends a search
+#define ARP_ITEM_FREE    0
+// Slot holds an address
+#define ARP_ITEM_USED    1
+// Slot held an address, a search continues past it
+#define ARP_ITEM_DELETED 2
+
 // Variables
 // ---------
 
-// Arp cache
+// Definition of an address being resolved
+typedef struct {
+    uint8_t ip[4];
+    // Number of requests sent, zero when the entry is unused
+    uint8_t tries;
+    // Seconds until the next request
+    volatile uint8_t timer;
+    // Packet waiting for the address and its length, zero when unused
+    uint16_t parked;
+    uint8_t park[NET_ARP_PARK_SIZE];
+#ifdef NET_NETWORK_POOL
+    // Packets waiting for the address, NETWORK_POOL_NONE when unused
+    uint8_t packets[NET_ARP_PENDING_PACKETS];
+#endif // NET_NETWORK_POOL
+} arp_pending_t;
+
+// Arp cache, open addressed on the last byte of the IP address
 arp_item_t cache[NET_ARP_CACHE_SIZE];
-// Next write index for a reply to a request
-volatile uint8_t cache_index = 0;
-// Are we waiting for a reply on a request
-volatile uint8_t waiting = 0;
+// Second of the last cache sweep
+uint16_t cache_swept = 0;
+// Changes when a cache slot gets another address
+uint8_t arp_generation = 0;
+// Addresses being resolved
+arp_pending_t pending[NET_ARP_PENDING_SIZE];
 
 #ifdef UTILS_WERKTI_MORE
 // Traffic from werkti
@@ -47,24 +90,26 @@ extern uint16_t werkti_arp_out;
 
 void arp_reply_to_request(void);
 void arp_prepare(uint8_t *dst_mac);
-void save_to_cache(void);
+void save_to_cache(uint8_t *ip, uint8_t *mac);
+#ifdef NET_ARP_SNOOP
+void refresh_cache(uint8_t *ip, uint8_t *mac);
+uint8_t is_probe(void);
+#endif // NET_ARP_SNOOP
 uint8_t *arp_search_mac(uint8_t *ip_request);
+void arp_cache_remove(uint8_t index);
+void arp_cache_sweep(void);
+void arp_send_request(uint8_t *ip_request);
+uint8_t arp_pending_find(uint8_t *ip_request);
+uint8_t arp_pending_start(uint8_t *ip_request);
+uint8_t arp_pending_claim(uint8_t *ip_request);
+void arp_pending_done(uint8_t index, uint8_t *mac);
 
 void arp_init(void) {
-    uint8_t i = 0, j = 0;
+    uint8_t i = 0;
 
-    // Initialize elements from arpItems
+    // Mark all cache slots free
     while (i < NET_ARP_CACHE_SIZE) {
-        j = 0;
-        while (j < 4) {
-            cache[i].ip[j]  = 0;
-            cache[i].mac[j] = 0;
-            j++;
-        }
-        while (j < 6) {
-            cache[i].mac[j] = 0;
-            j++;
-        }
+        cache[i].state = ARP_ITEM_FREE;
         i++;
     }
 }
@@ -83,11 +128,24 @@ void arp_receive(void) {
         // Is the packet for me?
         while (i < 4) {
             if (buffer_in[ARP_PTR_TARG_PROTO + i] != my_ip[i]) {
+#ifdef NET_ARP_SNOOP
+                // Overheard, only refresh a known address
+                if (!is_probe()) {
+                    refresh_cache(&buffer_in[ARP_PTR_SEND_PROTO], &buffer_in[ARP_PTR_SEND_HW]);
+                }
+#endif // NET_ARP_SNOOP
                 return; // Not my IP address
             }
             i++;
         }
 
+#ifdef NET_ARP_SNOOP
+        // The sender is going to talk to me, remember its address
+        if (!is_probe()) {
+            save_to_cache(&buffer_in[ARP_PTR_SEND_PROTO], &buffer_in[ARP_PTR_SEND_HW]);
+        }
+#endif // NET_ARP_SNOOP
+
         // It's meant for me, reply with my MAC address
         debug_string_p(PSTR("ARP: Request for me..."));
         arp_reply_to_request();
@@ -112,12 +170,9 @@ void arp_receive(void) {
 
         // It's meant for me, store value
         debug_string_p(PSTR("ARP: Reply for me "));
-        save_to_cache();
+        save_to_cache(&buffer_in[ARP_PTR_SEND_PROTO], &buffer_in[ARP_PTR_SEND_HW]);
         debug_string_p(PSTR("saved\r\n"));
 
-        // Reset waiting state
-        waiting = 0;
-
         // Packet handled, reset buffer length
         buffer_in_length = 0;
         return;
@@ -132,7 +187,281 @@ uint8_t *arp_request_mac(uint8_t *ip_request) {
         return mac_answer;
     }
 
-    // No entry existed, create a request and send it
+    // Start resolving the address, the answer comes in later
+    arp_pending_start(ip_request);
+    return 0;
+}
+
+uint8_t arp_send(uint8_t *ip_request, uint16_t length) {
+    uint8_t *mac;
+    uint8_t i = 0;
+
+    // Is the address known?
+    mac = arp_search_mac(ip_request);
+    if (mac != 0) {
+        // Set the destination and send the packet
+        while (i < 6) {
+            buffer_out[ETH_PTR_MAC_DST + i] = mac[i];
+            i++;
+        }
+        network_send(length);
+        return (ARP_SENT);
+    }
+
+    uint8_t index;
+    uint8_t fresh = 0;
+    uint8_t result = ARP_DROPPED;
+    uint16_t n = 0;
+
+    // Find or claim an entry, the request is sent after the packet is parked
+    // as it overwrites buffer_out
+    index = arp_pending_find(ip_request);
+    if (index == NET_ARP_PENDING_SIZE) {
+        index = arp_pending_claim(ip_request);
+        fresh = 1;
+    }
+    if (index == NET_ARP_PENDING_SIZE) {
+        return (ARP_DROPPED);
+    }
+
+    if (pending[index].parked == 0 && length <= NET_ARP_PARK_SIZE) {
+        // Park the packet with the entry
+        while (n < length) {
+            pending[index].park[n] = buffer_out[n];
+            n++;
+        }
+        pending[index].parked = length;
+        result = ARP_PENDING;
+    }
+#ifdef NET_NETWORK_POOL
+    else {
+        uint8_t handle;
+
+        // Park the packet in a pool buffer
+        handle = network_pool_store(length);
+        if (handle != NETWORK_POOL_NONE) {
+            // Find a spot for the packet
+            while (i < NET_ARP_PENDING_PACKETS) {
+                if (pending[index].packets[i] == NETWORK_POOL_NONE) {
+                    pending[index].packets[i] = handle;
+                    result = ARP_PENDING;
+                    break;
+                }
+                i++;
+            }
+            // No room to wait for the address
+            if (result == ARP_DROPPED) {
+                network_pool_release(handle);
+            }
+        }
+    }
+#endif // NET_NETWORK_POOL
+
+    // Start resolving the address
+    if (fresh) {
+        arp_send_request(ip_request);
+    }
+    return (result);
+}
+
+#ifdef NET_ARP_SNOOP
+void arp_snoop(void) {
+    uint8_t *ip = &buffer_in[IP_PTR_SRC];
+    uint8_t i = 0;
+
+    // Is the network known? Is it a unicast sender?
+    if (gateway_netmask[0] == 0 || (buffer_in[ETH_PTR_MAC_SRC] & 0x01)) {
+        return;
+    }
+
+    // Only senders on my subnet are reached directly, not mine or unset
+    while (i < 4) {
+        if ((ip[i] ^ my_ip[i]) & gateway_netmask[i]) {
+            return;
+        }
+        i++;
+    }
+    if (ip[3] == my_ip[3] && ip[2] == my_ip[2] && ip[1] == my_ip[1] && ip[0] == my_ip[0]) {
+        return;
+    }
+
+    save_to_cache(ip, &buffer_in[ETH_PTR_MAC_SRC]);
+}
+
+// A probe has no sender address yet, see RFC 5227, p. 6
+uint8_t is_probe(void) {
+    return (buffer_in[ARP_PTR_SEND_PROTO] == 0 && buffer_in[ARP_PTR_SEND_PROTO + 1] == 0
+        && buffer_in[ARP_PTR_SEND_PROTO + 2] == 0 && buffer_in[ARP_PTR_SEND_PROTO + 3] == 0);
+}
+#endif // NET_ARP_SNOOP
+
+void arp_announce(void) {
+    // A request for my own address tells everyone where it is
+    debug_string_p(PSTR("ARP: Announce\r\n"));
+    arp_send_request(my_ip);
+}
+
+void arp_poll(void) {
+    uint8_t i = 0;
+
+    // Age the cache once a second
+    if (counter_seconds() != cache_swept) {
+        arp_cache_sweep();
+    }
+
+    while (i < NET_ARP_PENDING_SIZE) {
+        // Is it time for the next request?
+        if (pending[i].tries && pending[i].timer == 0) {
+            if (pending[i].tries == NET_ARP_RETRIES) {
+                // No answer, give up on the address
+                debug_string_p(PSTR("ARP: No reply\r\n"));
+                arp_pending_done(i, 0);
+            } else {
+                // Wait twice as long for every retry
+                pending[i].timer = 1 << pending[i].tries;
+                pending[i].tries++;
+                arp_send_request(pending[i].ip);
+            }
+        }
+        i++;
+    }
+}
+
+void arp_tick(void) {
+    uint8_t i = 0;
+
+    // Count down the time until the next request
+    while (i < NET_ARP_PENDING_SIZE) {
+        if (pending[i].timer) {
+            pending[i].timer--;
+        }
+        i++;
+    }
+}
+
+uint8_t arp_pending_find(uint8_t *ip_request) {
+    uint8_t i = 0;
+
+    // Search the address, returns NET_ARP_PENDING_SIZE when not found
+    while (i < NET_ARP_PENDING_SIZE) {
+        if (pending[i].tries
+            && pending[i].ip[0] == ip_request[0]
+            && pending[i].ip[1] == ip_request[1]
+            && pending[i].ip[2] == ip_request[2]
+            && pending[i].ip[3] == ip_request[3]) {
+            break;
+        }
+        i++;
+    }
+    return (i);
+}
+
+uint8_t arp_pending_start(uint8_t *ip_request) {
+    uint8_t i;
+
+    // Already being resolved?
+    i = arp_pending_find(ip_request);
+    if (i < NET_ARP_PENDING_SIZE) {
+        return (i);
+    }
+
+    // First request right away
+    i = arp_pending_claim(ip_request);
+    if (i < NET_ARP_PENDING_SIZE) {
+        arp_send_request(ip_request);
+    }
+
+    return (i);
+}
+
+// Take an unused entry for an address, without sending the first request
+uint8_t arp_pending_claim(uint8_t *ip_request) {
+    uint8_t i = 0;
+    uint8_t j = 0;
+
+    // Find an unused entry
+    while (i < NET_ARP_PENDING_SIZE && pending[i].tries) {
+        i++;
+    }
+    if (i == NET_ARP_PENDING_SIZE) {
+        return (i);
+    }
+
+    while (j < 4) {
+        pending[i].ip[j] = ip_request[j];
+        j++;
+    }
+    pending[i].parked = 0;
+#ifdef NET_NETWORK_POOL
+    j = 0;
+    while (j < NET_ARP_PENDING_PACKETS) {
+        pending[i].packets[j] = NETWORK_POOL_NONE;
+        j++;
+    }
+#endif // NET_NETWORK_POOL
+
+    // The first request is sent by the caller, retry after a second
+    pending[i].timer = 1;
+    pending[i].tries = 1;
+
+    return (i);
+}
+
+void arp_pending_done(uint8_t index, uint8_t *mac) {
+    uint8_t i = 0;
+#ifdef NET_NETWORK_POOL
+    uint8_t j;
+    uint8_t *packet;
+#endif // NET_NETWORK_POOL
+
+    // Send the parked packet when the address is known, drop it otherwise
+    if (pending[index].parked) {
+        if (mac) {
+            while (i < 6) {
+                pending[index].park[ETH_PTR_MAC_DST + i] = mac[i];
+                i++;
+            }
+            network_send_buffer(pending[index].park, pending[index].parked);
+        }
+        pending[index].parked = 0;
+    }
+
+#ifdef NET_NETWORK_POOL
+    // Send the waiting packets when the address is known, drop them otherwise
+    i = 0;
+    while (i < NET_ARP_PENDING_PACKETS) {
+        if (pending[index].packets[i] != NETWORK_POOL_NONE) {
+            if (mac) {
+                packet = network_pool_data(pending[index].packets[i]);
+                j = 0;
+                while (j < 6) {
+                    packet[ETH_PTR_MAC_DST + j] = mac[j];
+                    j++;
+                }
+                network_pool_send(pending[index].packets[i]);
+            } else {
+                network_pool_release(pending[index].packets[i]);
+            }
+            pending[index].packets[i] = NETWORK_POOL_NONE;
+        }
+        i++;
+    }
+#endif // NET_NETWORK_POOL
+
+    // The address is gone, forget a stale cache entry
+    if (mac == 0) {
+        i = arp_cache_find(pending[index].ip);
+        if (i < NET_ARP_CACHE_SIZE) {
+            arp_cache_remove(i);
+        }
+    }
+
+    // Free the entry
+    pending[index].tries = 0;
+    pending[index].timer = 0;
+}
+
+void arp_send_request(uint8_t *ip_request) {
     uint8_t i = 0,
     all_FF[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 
@@ -161,31 +490,13 @@ uint8_t *arp_request_mac(uint8_t *ip_request) {
 #endif // UTILS_WERKTI_MORE
 
     network_send(ARP_LEN);
-
-    // Wait actively for an answer
-    waiting = 1;
-    while (waiting) {
-        // Process packets received
-        network_backbone();
-    }
-
-    // It should exist now
-    return arp_search_mac(ip_request);
 }
 
 void arp_reply_to_request(void) {
     uint8_t i = 0;
 
-    // Create ARP template based on request
-    arp_prepare(&buffer_in[ARP_PTR_SEND_HW]);
-
-    // Fill the missing parts of the packet:
-    // Operation, Sender hardware address, sender protocol address,
-    // target hardware address, target protocol address
-
-    // Operation: reply
-    buffer_out[ARP_PTR_OPER_H] = 0;
-    buffer_out[ARP_PTR_OPER_L] = ARP_VAL_OPER_REPLY;
+    // The sender of the request is the target of the reply, copy it first
+    // since buffer_out can be buffer_in
 
     // Target hardware address
     while (i < 6) {
@@ -200,6 +511,16 @@ void arp_reply_to_request(void) {
         i++;
     }
 
+    // Create ARP template based on request
+    arp_prepare(&buffer_out[ARP_PTR_TARG_HW]);
+
+    // Fill the missing parts of the packet:
+    // Operation, Sender hardware address, sender protocol address
+
+    // Operation: reply
+    buffer_out[ARP_PTR_OPER_H] = 0;
+    buffer_out[ARP_PTR_OPER_L] = ARP_VAL_OPER_REPLY;
+
 #ifdef UTILS_WERKTI_MORE
     // Update werkti arp send
     werkti_arp_out += ARP_LEN;
@@ -256,51 +577,152 @@ void arp_prepare(uint8_t *dst_mac) {
     }
 }
 
-void save_to_cache(void) {
-    uint8_t *ip_reply = &buffer_in[ARP_PTR_SEND_PROTO],
-    *mac_reply = &buffer_in[ARP_PTR_SEND_HW],
-    *ip_cache = cache[cache_index].ip,
-    *mac_cache = cache[cache_index].mac,
-    i = 0;
+void save_to_cache(uint8_t *ip_reply, uint8_t *mac_reply) {
+    uint8_t i, j, slot = 0;
+    uint16_t now = counter_seconds();
+    uint16_t oldest = 0;
 
-    // Search for MAC address to see if the combination already exists in the
-    // cache. If it doesn't, write an entry at arpWriteIndex
-    if (arp_search_mac(ip_reply) == 0) {
-        // Copy IP address and MAC address into cache
-        while (i < 4) {
-            ip_cache[i] = ip_reply[i];
-            mac_cache[i] = mac_reply[i];
+    i = arp_cache_find(ip_reply);
+    if (i == NET_ARP_CACHE_SIZE) {
+        // Take the first unused slot from the home slot on
+        i = ip_reply[3] % NET_ARP_CACHE_SIZE;
+        j = 0;
+        while (j < NET_ARP_CACHE_SIZE) {
+            if (cache[i].state != ARP_ITEM_USED) {
+                slot = i;
+                break;
+            }
+            // Remember the least recently used address
+            if ((uint16_t)(now - cache[i].used) >= oldest) {
+                oldest = now - cache[i].used;
+                slot = i;
+            }
             i++;
+            i %= NET_ARP_CACHE_SIZE;
+            j++;
         }
-        while (i < 6) {
-            mac_cache[i] = mac_reply[i];
-            i++;
+
+        // Slot is unused or holds the least recently used address
+        i = slot;
+        if (cache[i].state == ARP_ITEM_USED) {
+            arp_generation++;
+        }
+        cache[i].state = ARP_ITEM_USED;
+        cache[i].used = now;
+        j = 0;
+        while (j < 4) {
+            cache[i].ip[j] = ip_reply[j];
+            j++;
         }
+    }
 
-        // Update write index
-        cache_index++;
-        cache_index %= NET_ARP_CACHE_SIZE;
+    // Store the (new) MAC address
+    j = 0;
+    while (j < 6) {
+        cache[i].mac[j] = mac_reply[j];
+        j++;
     }
+    cache[i].confirmed = now;
 
+    // Send the packets waiting for the address
+    i = arp_pending_find(ip_reply);
+    if (i < NET_ARP_PENDING_SIZE) {
+        arp_pending_done(i, mac_reply);
+    }
 }
 
+#ifdef NET_ARP_SNOOP
+void refresh_cache(uint8_t *ip, uint8_t *mac) {
+    uint8_t i = arp_cache_find(ip);
+    uint8_t j = 0;
+
+    // Update a known address only
+    if (i < NET_ARP_CACHE_SIZE) {
+        while (j < 6) {
+            cache[i].mac[j] = mac[j];
+            j++;
+        }
+        cache[i].confirmed = counter_seconds();
+    }
+}
+#endif // NET_ARP_SNOOP
+
 uint8_t *arp_search_mac(uint8_t *ip_request) {
-    uint8_t i = 0;
+    uint8_t i = arp_cache_find(ip_request);
+
+    if (i < NET_ARP_CACHE_SIZE) {
+        return arp_cache_use(i);
+    }
+
+    return 0;
+}
+
+uint8_t *arp_cache_use(uint8_t index) {
+    // Used, keep it in the cache
+    cache[index].used = counter_seconds();
+    return cache[index].mac;
+}
+
+uint8_t arp_cache_find(uint8_t *ip_request) {
+    // Start at the home slot of the address
+    uint8_t i = ip_request[3] % NET_ARP_CACHE_SIZE;
+    uint8_t j = 0;
     uint8_t *ip_cache;
 
-    while (i < NET_ARP_CACHE_SIZE) {
+    // Search until a never used slot, returns NET_ARP_CACHE_SIZE when not found
+    while (j < NET_ARP_CACHE_SIZE && cache[i].state != ARP_ITEM_FREE) {
         ip_cache = cache[i].ip;
-        if (ip_cache[0] == ip_request[0]
+        if (cache[i].state == ARP_ITEM_USED
+            && ip_cache[0] == ip_request[0]
             && ip_cache[1] == ip_request[1]
             && ip_cache[2] == ip_request[2]
             && ip_cache[3] == ip_request[3]) {
-            // IP address matches, return MAC address
-            return cache[i].mac;
+            return i;
         }
         i++;
+        i %= NET_ARP_CACHE_SIZE;
+        j++;
     }
 
-    return 0;
+    return NET_ARP_CACHE_SIZE;
+}
+
+void arp_cache_remove(uint8_t index) {
+    // The slot no longer holds the address
+    arp_generation++;
+
+    // Searches have to continue past the slot when the next one is not free
+    if (cache[(index + 1) % NET_ARP_CACHE_SIZE].state != ARP_ITEM_FREE) {
+        cache[index].state = ARP_ITEM_DELETED;
+        return;
+    }
+
+    // End of a chain, free the slot and the deleted slots before it
+    cache[index].state = ARP_ITEM_FREE;
+    index = (index + NET_ARP_CACHE_SIZE - 1) % NET_ARP_CACHE_SIZE;
+    while (cache[index].state == ARP_ITEM_DELETED) {
+        cache[index].state = ARP_ITEM_FREE;
+        index = (index + NET_ARP_CACHE_SIZE - 1) % NET_ARP_CACHE_SIZE;
+    }
+}
+
+void arp_cache_sweep(void) {
+    uint8_t i = 0;
+    uint16_t now = counter_seconds();
+
+    cache_swept = now;
+    while (i < NET_ARP_CACHE_SIZE) {
+        if (cache[i].state == ARP_ITEM_USED) {
+            if ((uint16_t)(now - cache[i].used) >= NET_ARP_TTL) {
+                // Not used for a while, forget it
+                arp_cache_remove(i);
+            } else if ((uint16_t)(now - cache[i].confirmed) >= NET_ARP_TTL) {
+                // Still in use, check whether the address is still valid
+                arp_pending_start(cache[i].ip);
+            }
+        }
+        i++;
+    }
 }
 
 
@@ -46,9 +46,87 @@ extern void arp_receive(void);
 /**
  * @brief Request the MAC address that corresponds to <i>ip_request</i>.
  *
+ * Returns the address from the cache. When it is not known, a request is
+ * sent and zero is returned, try again later. The request is retried
+ * NET_ARP_RETRIES times with a doubling interval.
+ *
+ * @note Sending a request overwrites <i>buffer_out</i>.
  * @param ip_request The IP address to request the MAC address of
+ * @return Pointer to the MAC address, zero while it is being resolved
  */
 extern uint8_t *arp_request_mac(uint8_t *ip_request);
 
+/**
+ * @brief Find the cache slot of <i>ip_request</i>
+ *
+ * @param ip_request The IP address to search
+ * @return Slot of the address, NET_ARP_CACHE_SIZE when it is not cached
+ */
+extern uint8_t arp_cache_find(uint8_t *ip_request);
+
+/**
+ * @brief Mark a cache slot used and return its MAC address
+ *
+ * @param index Slot returned by arp_cache_find()
+ * @return Pointer to the MAC address
+ */
+extern uint8_t *arp_cache_use(uint8_t index);
+
+/**
+ * @brief Changes when a cache slot found by arp_cache_find() is removed or
+ * replaced
+ */
+extern uint8_t arp_generation;
+
+/**
+ * @brief Send the IP packet in <i>buffer_out</i> to <i>ip_request</i>
+ *
+ * Sets the destination MAC address and sends the packet. When the address is
+ * not known yet, the packet is kept while the address is resolved and sent
+ * when the reply arrives. One packet of up to NET_ARP_PARK_SIZE bytes is kept
+ * per address, with NET_NETWORK_POOL NET_ARP_PENDING_PACKETS more in pool
+ * buffers. It is dropped when no reply comes.
+ *
+ * @param ip_request The IP address of the next hop
+ * @param length Length of the packet
+ * @return ARP_SENT, ARP_PENDING or ARP_DROPPED
+ */
+extern uint8_t arp_send(uint8_t *ip_request, uint16_t length);
+
+#ifdef NET_ARP_SNOOP
+/**
+ * @brief Learn the address of the sender of the IP packet in <i>buffer_in</i>
+ *
+ * Senders on the own subnet are stored in the cache, so no request is needed
+ * to answer them later.
+ *
+ * @note Should not be called by users, it is called by network_backbone.
+ */
+extern void arp_snoop(void);
+#endif // NET_ARP_SNOOP
+
+/**
+ * @brief Send a gratuitous ARP request for the own IP address
+ *
+ * Neighbours update their caches, called when the address is set.
+ */
+extern void arp_announce(void);
+
+/**
+ * @brief Retry requests and drop packets of unanswered requests
+ *
+ * @note Should not be called by users, it is called by network_backbone.
+ */
+extern void arp_poll(void);
+
+/**
+ * @brief Count down the request retry timers, called every second
+ */
+extern void arp_tick(void);
+
+#define ARP_DROPPED 0
+#define ARP_SENT    1
+#define ARP_PENDING 2
+
 #endif // NET_ARP
 #endif // NET_ARP_H
@@ -360,6 +360,8 @@ uint8_t is_packet_for_me(void) {
         || buffer_in[UDP_PTR_DATA + 6] != transaction_id
         || buffer_in[UDP_PTR_DATA + 7] != transaction_id)
         return (0);
+    // Load the options of the packet
+    network_fetch();
     // We can be sure it's for us now
     return (1);
 }
@@ -586,11 +588,28 @@ uint16_t dhcp_renew(void) {
             // Check if this packet is part of a renew
             if (is_transaction_id()) {
                 // Get information from packet
+#ifdef NET_ARP
+                // The address may have changed
+                uint8_t old_ip[4];
+                uint8_t i = 0;
+                while (i < 4) {
+                    old_ip[i] = my_ip[i];
+                    i++;
+                }
+#endif // NET_ARP
+                parse_ip_address();
                 // New lease time
                 debug_string_p(PSTR("DHCP: Received new lease time\r\n"));
                 parse_options();
                 // Packet handled, reset buffer length
                 buffer_in_length = 0;
+#ifdef NET_ARP
+                // Let the network know the new address is in use
+                if (old_ip[0] != my_ip[0] || old_ip[1] != my_ip[1]
+                    || old_ip[2] != my_ip[2] || old_ip[3] != my_ip[3]) {
+                    arp_announce();
+                }
+#endif // NET_ARP
             }
         }
         return (0);
@@ -14,6 +14,7 @@
 #ifdef NET_ICMP
 
 void icmp_ping_reply();
+void icmp_ping_reply_copy();
 
 void icmp_packet_receive() {
 
@@ -26,6 +27,10 @@ void icmp_packet_receive() {
 
     if(type == ICMP_VAL_TYPE_ECHOREQUEST) {
         debug_string_p(PSTR("ICMP: Request - "));
+#ifndef NET_ICMP_ZERO_COPY
+        // Load the data of the request
+        network_fetch();
+#endif // NET_ICMP_ZERO_COPY
         icmp_ping_reply();
         debug_string_p(PSTR("sent\r\n"));
         // Packet handled, reset length
@@ -34,8 +39,81 @@ void icmp_packet_receive() {
 
 }
 
+#ifdef NET_ICMP_ZERO_COPY
+
 void icmp_ping_reply() {
     uint8_t i = 0;
+    uint8_t patch[ICMP_PTR_CHECKSUM_L - IP_PTR_SRC + 1];
+    uint16_t length;
+    uint16_t check;
+
+    // Send back the packet we get, except for some minor changes. The network
+    // chip copies the packet, only the changes are written.
+    // - Swap sender and receiver in ETH header
+    // - Swap sender and receiver in IP header
+    // - Change ICMP type from request (8) to reply (0)
+    // - Update ICMP checksum
+
+    // Copy packet in the network chip
+    length = network_tx_load_received();
+    if (length == 0) {
+        // Not in the receive buffer of the chip (e.g. taken from the pool),
+        // reply from buffer_in instead
+        network_fetch();
+        icmp_ping_reply_copy();
+        return;
+    }
+
+    // Swap sender and receiver in ETH header
+    // Use own MAC address for sender
+    while (i < 6) {
+        patch[ETH_PTR_MAC_DST + i] = buffer_in[ETH_PTR_MAC_SRC + i];
+        patch[ETH_PTR_MAC_SRC + i] = my_mac[i];
+        i++;
+    }
+    network_tx_write(ETH_PTR_MAC_DST, 12, patch);
+
+    // Swap sender and receiver in IP header, the IP header checksum does not
+    // change by swapping
+    i = 0;
+    while (i < 4) {
+        patch[IP_PTR_DST - IP_PTR_SRC + i] = buffer_in[IP_PTR_SRC + i];
+        patch[i] = my_ip[i];
+        i++;
+    }
+
+    // Change ICMP type from request (8) to reply (0), keep code
+    patch[ICMP_PTR_TYPE - IP_PTR_SRC] = ICMP_VAL_TYPE_ECHOREPLY;
+    patch[ICMP_PTR_CODE - IP_PTR_SRC] = buffer_in[ICMP_PTR_CODE];
+
+    // Update ICMP header checksum
+    // Only the type of the packet is changed compared to the received packet
+    check = checksum_update((buffer_in[ICMP_PTR_CHECKSUM_H] << 8) | buffer_in[ICMP_PTR_CHECKSUM_L],
+        ICMP_VAL_TYPE_ECHOREQUEST << 8, ICMP_VAL_TYPE_ECHOREPLY << 8);
+    patch[ICMP_PTR_CHECKSUM_H - IP_PTR_SRC] = check >> 8;
+    patch[ICMP_PTR_CHECKSUM_L - IP_PTR_SRC] = check & 0xFF;
+    network_tx_write(IP_PTR_SRC, sizeof(patch), patch);
+
+#ifdef UTILS_WERKTI_MORE
+    // Update werkti icmp out
+    werkti_icmp_out += length;
+#endif // UTILS_WERKTI_MORE
+
+    // Send packet
+    network_tx_send(length);
+}
+
+#else
+
+void icmp_ping_reply() {
+    icmp_ping_reply_copy();
+}
+
+#endif // NET_ICMP_ZERO_COPY
+
+void icmp_ping_reply_copy() {
+    uint16_t i = 0;
+    uint16_t check;
 
     // Send back the packet we get, except for some minor changes.
     // - Swap sender and receiver in ETH header
@@ -43,11 +121,13 @@ void icmp_ping_reply() {
     // - Change ICMP type from request (8) to reply (0)
     // - Update ICMP checksum
 
-    // Copy buffer
+#ifndef NET_NETWORK_SHARED_BUFFER
+    // Copy buffer, with a shared buffer the reply is made in place
     while (i < buffer_in_length) {
         buffer_out[i] = buffer_in[i];
         i++;
     }
+#endif // NET_NETWORK_SHARED_BUFFER
 
     // Swap sender and receiver in ETH header
     // Use own MAC address for sender
@@ -70,13 +150,11 @@ void icmp_ping_reply() {
     buffer_out[ICMP_PTR_TYPE] = ICMP_VAL_TYPE_ECHOREPLY;
 
     // Update ICMP header checksum
-    // Since only the type of the packet is changed compared to the received
-    // packet, we can copy the checksum and add 0x08 to it. This is correct
-    // since it's 1st complement.
-    buffer_out[ICMP_PTR_CHECKSUM_H] += 0x08;
-    if (buffer_in[ICMP_PTR_CHECKSUM_H] > (0xFF - 0x08)) {
-        buffer_out[ICMP_PTR_CHECKSUM_L]++;
-    }
+    // Only the type of the packet is changed compared to the received packet
+    check = checksum_update((buffer_out[ICMP_PTR_CHECKSUM_H] << 8) | buffer_out[ICMP_PTR_CHECKSUM_L],
+        ICMP_VAL_TYPE_ECHOREQUEST << 8, ICMP_VAL_TYPE_ECHOREPLY << 8);
+    buffer_out[ICMP_PTR_CHECKSUM_H] = check >> 8;
+    buffer_out[ICMP_PTR_CHECKSUM_L] = check & 0xFF;
 
 #ifdef UTILS_WERKTI_MORE
     // Update werkti icmp out
@@ -0,0 +1,295 @@
+/**
+ * @file igmp.c
+ *
+ * \copyright Copyright 2013 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * @author Ferdi van der Werf <efcm@slashdev.nl>
+ * @since 0.15.0
+ */
+
+#include "igmp.h"
+
+// Do we want IGMP?
+#ifdef NET_IGMP
+
+#ifndef NET_NETWORK_MULTICAST
+#error IGMP cannot function without NET_NETWORK_MULTICAST defined
+#endif // NET_NETWORK_MULTICAST
+#ifndef NET_IGMP_GROUPS
+#error IGMP cannot function without NET_IGMP_GROUPS defined
+#endif // NET_IGMP_GROUPS
+#ifndef UTILS_COUNTER
+#error IGMP needs UTILS_COUNTER to delay reports
+#endif // UTILS_COUNTER
+
+// Max Resp Time of IGMPv1 queries, in tenths of a second
+// See RFC 2236, p. 10, chap. 4
+#define IGMP_MAX_RESP_V1 100
+
+// Variables
+// ---------
+
+// Joined groups, an unused entry is 0.0.0.0
+uint8_t igmp_groups[NET_IGMP_GROUPS][4];
+// Counter ticks until the report of a group is sent, zero when none waits
+uint16_t igmp_timers[NET_IGMP_GROUPS];
+// Counter tick of the last igmp_poll
+uint8_t igmp_ticks;
+
+// All hosts group, receives the queries
+const uint8_t igmp_all_hosts[4] = { 224, 0, 0, 1 };
+// All routers group, receives the leaves
+const uint8_t igmp_all_routers[4] = { 224, 0, 0, 2 };
+
+// Functions
+// ---------
+
+void igmp_send(uint8_t type, uint8_t *group);
+uint8_t igmp_find(uint8_t *group);
+void igmp_schedule(uint8_t index, uint16_t max);
+
+void igmp_init(void) {
+    uint8_t mac[6];
+
+    // Hosts with another MAC address pick other delays
+    srand(((uint16_t)my_mac[4] << 8) | my_mac[5]);
+
+    // Receive queries, membership of all hosts is never reported
+    // See RFC 2236, p. 6, chap. 3
+    igmp_group_mac((uint8_t *)igmp_all_hosts, mac);
+    network_multicast_join(mac);
+}
+
+void igmp_receive(void) {
+    uint8_t *igmp;
+    uint8_t i = 0;
+    uint16_t max;
+
+    // IGMP message starts after the IP header, which has the router alert
+    // option in IGMPv2 packets
+    igmp = &buffer_in[IP_PTR + ((buffer_in[IP_PTR_HEADER_LEN] & 0x0F) << 2)];
+    if (igmp + IGMP_LEN_HEADER > &buffer_in[buffer_in_length]) {
+        return;
+    }
+
+    // Another host reported a group, ours is not needed anymore
+    // See RFC 2236, p. 6, chap. 3
+    if (igmp[IGMP_OFF_TYPE] == IGMP_VAL_TYPE_REPORT || igmp[IGMP_OFF_TYPE] == IGMP_VAL_TYPE_REPORT_V1) {
+        if (igmp[IGMP_OFF_GROUP] != 0) {
+            i = igmp_find(&igmp[IGMP_OFF_GROUP]);
+            if (i < NET_IGMP_GROUPS) {
+                igmp_timers[i] = 0;
+            }
+        }
+        return;
+    }
+
+    // Only queries need an answer
+    if (igmp[IGMP_OFF_TYPE] != IGMP_VAL_TYPE_QUERY) {
+        return;
+    }
+
+    // Answer within Max Resp Time, in tenths of a second
+    max = igmp[IGMP_OFF_MAX_RESP];
+    if (max == 0) {
+        max = IGMP_MAX_RESP_V1;
+    }
+    max = max * COUNTER_TICKS_PER_SECOND / 10;
+
+    // Is it a general query?
+    if (igmp[IGMP_OFF_GROUP]     == 0 && igmp[IGMP_OFF_GROUP + 1] == 0
+     && igmp[IGMP_OFF_GROUP + 2] == 0 && igmp[IGMP_OFF_GROUP + 3] == 0) {
+        // Report every joined group
+        while (i < NET_IGMP_GROUPS) {
+            if (igmp_groups[i][0] != 0) {
+                igmp_schedule(i, max);
+            }
+            i++;
+        }
+    } else {
+        // Group specific query, report when joined
+        i = igmp_find(&igmp[IGMP_OFF_GROUP]);
+        if (i < NET_IGMP_GROUPS) {
+            igmp_schedule(i, max);
+        }
+    }
+}
+
+// Start the report timer of a group with a random delay up to max ticks, an
+// earlier running timer is kept
+// See RFC 2236, p. 6, chap. 3
+void igmp_schedule(uint8_t index, uint16_t max) {
+    uint16_t delay = rand() % max + 1;
+
+    if (igmp_timers[index] == 0 || igmp_timers[index] > delay) {
+        igmp_timers[index] = delay;
+    }
+}
+
+void igmp_poll(void) {
+    uint8_t i = 0;
+    uint8_t elapsed;
+
+    // Ticks since the last poll
+    elapsed = counter_ticks() - igmp_ticks;
+    igmp_ticks += elapsed;
+
+    // Send the reports whose delay passed
+    while (i < NET_IGMP_GROUPS) {
+        if (igmp_timers[i]) {
+            if (igmp_timers[i] > elapsed) {
+                igmp_timers[i] -= elapsed;
+            } else {
+                igmp_timers[i] = 0;
+                igmp_send(IGMP_VAL_TYPE_REPORT, igmp_groups[i]);
+            }
+        }
+        i++;
+    }
+}
+
+uint8_t igmp_join(uint8_t *group) {
+    uint8_t empty[4] = { 0, 0, 0, 0 };
+    uint8_t mac[6];
+    uint8_t i;
+    uint8_t j = 0;
+
+    // Already joined?
+    if (igmp_find(group) < NET_IGMP_GROUPS) {
+        return (1);
+    }
+
+    // Find an unused entry
+    i = igmp_find(empty);
+    if (i == NET_IGMP_GROUPS) {
+        return (0);
+    }
+    while (j < 4) {
+        igmp_groups[i][j] = group[j];
+        j++;
+    }
+    igmp_timers[i] = 0;
+
+    // Receive the group
+    igmp_group_mac(group, mac);
+    network_multicast_join(mac);
+
+    // Unsolicited report
+    igmp_send(IGMP_VAL_TYPE_REPORT, group);
+
+    info_string_p(PSTR("IGMP: Join "));
+    info_ip(group);
+    info_newline();
+
+    return (1);
+}
+
+void igmp_leave(uint8_t *group) {
+    uint8_t mac[6];
+    uint8_t i;
+    uint8_t j = 0;
+
+    // Is the group joined?
+    i = igmp_find(group);
+    if (i == NET_IGMP_GROUPS) {
+        return;
+    }
+
+    // Tell the routers we leave
+    igmp_send(IGMP_VAL_TYPE_LEAVE, group);
+
+    // Stop receiving the group
+    igmp_group_mac(group, mac);
+    network_multicast_leave(mac);
+
+    // Free the entry
+    while (j < 4) {
+        igmp_groups[i][j] = 0;
+        j++;
+    }
+    igmp_timers[i] = 0;
+}
+
+void igmp_group_mac(uint8_t *group, uint8_t *mac) {
+    // Lower 23 bits of the group after 01:00:5E
+    // See RFC 1112, p. 13, chap. 6.4
+    mac[0] = 0x01;
+    mac[1] = 0x00;
+    mac[2] = 0x5E;
+    mac[3] = group[1] & 0x7F;
+    mac[4] = group[2];
+    mac[5] = group[3];
+}
+
+uint8_t igmp_find(uint8_t *group) {
+    uint8_t i = 0;
+
+    // Search the group, returns NET_IGMP_GROUPS when not found
+    while (i < NET_IGMP_GROUPS) {
+        if (igmp_groups[i][0] == group[0] && igmp_groups[i][1] == group[1]
+         && igmp_groups[i][2] == group[2] && igmp_groups[i][3] == group[3]) {
+            break;
+        }
+        i++;
+    }
+    return (i);
+}
+
+void igmp_send(uint8_t type, uint8_t *group) {
+    uint8_t *dst_ip;
+    uint8_t mac[6];
+    uint16_t tmp;
+
+    // Reports go to the group, leaves to all routers
+    // See RFC 2236, p. 3, chap. 2
+    if (type == IGMP_VAL_TYPE_LEAVE) {
+        dst_ip = (uint8_t *)igmp_all_routers;
+    } else {
+        dst_ip = group;
+    }
+    igmp_group_mac(dst_ip, mac);
+
+    // Create IP header
+    ip_prepare(IP_VAL_PROTO_IGMP, dst_ip, mac);
+
+    // Header of 24 bytes with the router alert option and TTL 1
+    // See RFC 2113, p. 1, chap. 2.1
+    buffer_out[IP_PTR_HEADER_LEN] = 0x46;
+    buffer_out[IP_PTR_TTL] = 1;
+    buffer_out[IGMP_PTR_ROUTER_ALERT]     = 0x94;
+    buffer_out[IGMP_PTR_ROUTER_ALERT + 1] = 0x04;
+    buffer_out[IGMP_PTR_ROUTER_ALERT + 2] = 0x00;
+    buffer_out[IGMP_PTR_ROUTER_ALERT + 3] = 0x00;
+
+    // IP packet length
+    tmp = IP_LEN_HEADER + IGMP_LEN_ROUTER_ALERT + IGMP_LEN_HEADER;
+    buffer_out[IP_PTR_LENGTH_H] = tmp >> 8;
+    buffer_out[IP_PTR_LENGTH_L] = tmp & 0xFF;
+
+    // Calculate checksum IP header
+    tmp = checksum(&buffer_out[IP_PTR], IP_LEN_HEADER + IGMP_LEN_ROUTER_ALERT, CHK_IP);
+    buffer_out[IP_PTR_CHECKSUM_H] = tmp >> 8;
+    buffer_out[IP_PTR_CHECKSUM_L] = tmp & 0xFF;
+
+    // IGMP message
+    // See RFC 2236, p. 2, chap. 2
+    buffer_out[IGMP_PTR + IGMP_OFF_TYPE] = type;
+    buffer_out[IGMP_PTR + IGMP_OFF_MAX_RESP] = 0;
+    buffer_out[IGMP_PTR + IGMP_OFF_CHECKSUM] = 0;
+    buffer_out[IGMP_PTR + IGMP_OFF_CHECKSUM + 1] = 0;
+    buffer_out[IGMP_PTR + IGMP_OFF_GROUP]     = group[0];
+    buffer_out[IGMP_PTR + IGMP_OFF_GROUP + 1] = group[1];
+    buffer_out[IGMP_PTR + IGMP_OFF_GROUP + 2] = group[2];
+    buffer_out[IGMP_PTR + IGMP_OFF_GROUP + 3] = group[3];
+
+    // Calculate checksum IGMP message
+    tmp = checksum(&buffer_out[IGMP_PTR], IGMP_LEN_HEADER, CHK_IP);
+    buffer_out[IGMP_PTR + IGMP_OFF_CHECKSUM]     = tmp >> 8;
+    buffer_out[IGMP_PTR + IGMP_OFF_CHECKSUM + 1] = tmp & 0xFF;
+
+    // Send packet to chip
+    network_send(ETH_LEN_HEADER + IP_LEN_HEADER + IGMP_LEN_ROUTER_ALERT + IGMP_LEN_HEADER);
+}
+
+#endif // NET_IGMP
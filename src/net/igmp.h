@@ -0,0 +1,83 @@
+/**
+ * @file igmp.h
+ * @brief Internet Group Management Protocol functionality
+ *
+ * This contains a minimal IGMPv2 host. Joined groups are reported to the
+ * routers and switches on the network, queries are answered so the groups
+ * stay alive and a leave is sent when a group is not used anymore.
+ *
+ * \copyright Copyright 2013 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * @author Ferdi van der Werf <efcm@slashdev.nl>
+ * @since 0.15.0
+ */
+
+#ifndef NET_IGMP_H
+#define NET_IGMP_H
+
+#include "../config.h"
+
+// Do we want IGMP?
+#ifdef NET_IGMP
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include "network.h"
+#include "shared.h"
+#include "../utils/logger.h"
+
+/**
+ * @brief Initialize IGMP
+ *
+ * Receives the all hosts group (224.0.0.1) to which queries are sent.
+ */
+extern void igmp_init(void);
+
+/**
+ * @brief Handle received IGMP packets
+ *
+ * <i>network_backbone</i> calls this function when it verified an IGMP packet
+ * is in <i>buffer_in</i>. Membership queries start a random delay up to the
+ * Max Resp Time for every joined group the query asks for, the report is sent
+ * by igmp_poll() when it passes. A report of another host for the group
+ * cancels it.
+ */
+extern void igmp_receive(void);
+
+/**
+ * @brief Send the reports whose delay passed
+ *
+ * @note Should not be called by users, it is called by network_backbone.
+ */
+extern void igmp_poll(void);
+
+/**
+ * @brief Join a multicast group
+ *
+ * Receives the packets of the group and reports the membership.
+ *
+ * @param group IP address of the group, 4 bytes
+ * @return One on success, zero when NET_IGMP_GROUPS groups are joined
+ */
+extern uint8_t igmp_join(uint8_t *group);
+
+/**
+ * @brief Leave a multicast group
+ *
+ * Stops receiving the packets of the group and tells the routers.
+ *
+ * @param group IP address of a joined group, 4 bytes
+ */
+extern void igmp_leave(uint8_t *group);
+
+/**
+ * @brief Get the MAC address of a multicast group
+ *
+ * @param group IP address of the group, 4 bytes
+ * @param mac Buffer of 6 bytes for the MAC address
+ */
+extern void igmp_group_mac(uint8_t *group, uint8_t *mac);
+
+#endif // NET_IGMP
+#endif // NET_IGMP_H
@@ -24,6 +24,24 @@
 #if BUFFER_OUT_SIZE > 1500
 #error BUFFER_OUT_SIZE larger than network chip can handle
 #endif
+#if defined(NET_NETWORK_SHARED_BUFFER) && BUFFER_OUT_SIZE > BUFFER_IN_SIZE
+#error BUFFER_OUT_SIZE should not exceed BUFFER_IN_SIZE with NET_NETWORK_SHARED_BUFFER
+#endif
+#if defined(NET_NETWORK_POOL) && (defined(NET_NETWORK_SHARED_BUFFER) || defined(NET_NETWORK_LAZY_RECEIVE))
+#error NET_NETWORK_POOL can not be combined with NET_NETWORK_SHARED_BUFFER or NET_NETWORK_LAZY_RECEIVE
+#endif
+#if defined(NET_NETWORK_POOL) && (NET_NETWORK_POOL_SIZE < 2 || NET_NETWORK_POOL_SIZE > 8)
+#error NET_NETWORK_POOL_SIZE should be between 2 and 8
+#endif
+#if NET_NETWORK_TX_SLOTS < 1 || NET_NETWORK_TX_SLOTS > 4
+#error NET_NETWORK_TX_SLOTS should be between 1 and 4
+#endif
+#if defined(NET_NETWORK_INTERRUPT_LATENCY) && !defined(NET_NETWORK_INTERRUPT)
+#error NET_NETWORK_INTERRUPT_LATENCY requires NET_NETWORK_INTERRUPT
+#endif
+#if defined(NET_NETWORK_LAZY_RECEIVE) && BUFFER_IN_SIZE < NETWORK_HEADER_SIZE
+#error BUFFER_IN_SIZE should at least hold NETWORK_HEADER_SIZE with NET_NETWORK_LAZY_RECEIVE
+#endif
 
 // Defines
 // ---------
@@ -38,10 +56,47 @@
 #define NETWORK_CTR_SO  PORTB6
 #define NETWORK_CTR_SCK PORTB7
 
+#ifdef NET_NETWORK_INTERRUPT
+// Interrupt pin of the network chip, connected to INT2
+#define NETWORK_INT_PIN  PINB
+#define NETWORK_INT_DDR  DDRB
+#define NETWORK_CTR_INT  PINB2
+// The interrupt pin is active low and stays low while a packet is pending
+#define NETWORK_INT_ASSERTED() (!(NETWORK_INT_PIN & (1 << NETWORK_CTR_INT)))
+#endif // NET_NETWORK_INTERRUPT
+
+// SPI clock, double speed runs the bus at F_CPU / 2
+#ifdef NET_NETWORK_SPI_DOUBLE_SPEED
+#define NETWORK_SPI_CLOCK_RATE SPI_CLOCK_RATE_FOSC_2
+#else
+#define NETWORK_SPI_CLOCK_RATE SPI_CLOCK_RATE_FOSC_4
+#endif // NET_NETWORK_SPI_DOUBLE_SPEED
+
 // Enable or disable SPI selector
+#ifdef NET_NETWORK_SPI_STATS
+// Count every SPI transaction with the network chip
+#define NETWORK_SPI_ACTIVE() do { network_spi_transactions++; SPI_ACTIVE(NETWORK_PORT, NETWORK_CTR_CS); } while (0)
+#else
 #define NETWORK_SPI_ACTIVE() SPI_ACTIVE(NETWORK_PORT, NETWORK_CTR_CS)
+#endif // NET_NETWORK_SPI_STATS
 #define NETWORK_SPI_PASSIVE() SPI_PASSIVE(NETWORK_PORT, NETWORK_CTR_CS)
 
+// Size of the receive status vector in front of every received packet
+// See datasheet p. 43
+#define NETWORK_RSV_SIZE 6
+
+// Maximum size of an ethernet frame, including CRC
+#define NETWORK_MAX_FRAME_SIZE 1518
+
+// Largest packet the chip accepts, including CRC
+#ifdef NET_NETWORK_LAZY_RECEIVE
+// Packets are left in the chip, accept every valid ethernet frame
+#define NETWORK_MAX_RECEIVE NETWORK_MAX_FRAME_SIZE
+#else
+// Do not recieve packets larger than BUFFER_IN_SIZE
+#define NETWORK_MAX_RECEIVE BUFFER_IN_SIZE
+#endif // NET_NETWORK_LAZY_RECEIVE
+
 // Variables
 // ---------
 
@@ -53,13 +108,114 @@ extern uint8_t my_mac[];
 static uint8_t bank;
 // Next packet pointer
 static uint16_t next_packet_ptr;
-
+// Last known value of the buffer read pointer (ERDPT)
+static uint16_t read_ptr;
+// Start of the data of the current packet in the receive buffer
+static uint16_t packet_ptr;
+// Is the current packet still occupying the receive buffer?
+static uint8_t packet_pending;
+// Length of the packet in every transmit slot
+static uint16_t tx_length[NET_NETWORK_TX_SLOTS];
+// Slot which is transmitted, or is next to be transmitted
+static uint8_t tx_head;
+// Slot in which the next packet is loaded
+static uint8_t tx_tail;
+// Number of packets queued, including the one being transmitted
+static uint8_t tx_count;
+// Is the packet in tx_head being transmitted?
+static uint8_t tx_busy;
+// Is the packet in tx_head sent again after a transmit error?
+static uint8_t tx_retried;
+// Length of the packet gathered with network_tx_append
+static uint16_t tx_gather_length;
+// One's complement sum of the appended data
+static uint32_t tx_gather_sum;
+#ifdef NET_NETWORK_LAZY_RECEIVE
+// Number of bytes of the current packet loaded into buffer_in
+static uint16_t buffer_in_loaded;
+#endif // NET_NETWORK_LAZY_RECEIVE
+
+#ifdef NET_NETWORK_INTERRUPT
+#ifdef UTILS_COUNTER
+// Second of the last EPKTCNT poll without the interrupt pin
+static uint16_t interrupt_poll_second;
+#else
+// Receive calls since the last EPKTCNT poll without the interrupt pin
+static uint8_t interrupt_poll_count;
+#endif // UTILS_COUNTER
+#endif // NET_NETWORK_INTERRUPT
+
+#ifdef NET_NETWORK_INTERRUPT_LATENCY
+// Timer 1 value when the interrupt pin fell
+static volatile uint16_t interrupt_stamp;
+#ifdef UTILS_COUNTER_TIMER1
+// Counter tick and second when the interrupt pin fell, timer 1 wraps every tick
+static volatile uint8_t interrupt_stamp_tick;
+static volatile uint16_t interrupt_stamp_second;
+#endif // UTILS_COUNTER_TIMER1
+// Is interrupt_stamp waiting to be handled?
+static volatile uint8_t interrupt_stamped;
+// Last and largest latency between interrupt and reading the packet
+uint16_t network_interrupt_latency;
+uint16_t network_interrupt_latency_max;
+#endif // NET_NETWORK_INTERRUPT_LATENCY
+
+// Phy status as returned by network_status, updated on link changes
+static uint8_t link_status;
+// Callbacks called on link changes
+static void (*link_listeners[NET_NETWORK_LINK_LISTENERS])(uint8_t up);
+
+#ifdef NET_NETWORK_MULTICAST
+// Number of joined multicast addresses in every bucket of the hash table
+static uint8_t multicast_buckets[64];
+#endif // NET_NETWORK_MULTICAST
+
+#ifdef NET_NETWORK_SPI_STATS
+// SPI transactions in total and for the last received packet
+uint16_t network_spi_transactions;
+uint8_t  network_spi_frame_transactions;
+#endif // NET_NETWORK_SPI_STATS
+
+#ifdef NET_NETWORK_POOL
+// Buffer of the pool
+typedef struct {
+    // Number of references, zero when free
+    uint8_t refs;
+    // Length of the packet in the buffer
+    uint16_t length;
+    uint8_t data[BUFFER_IN_SIZE+1];
+} pool_buffer_t;
+
+// Pool of packet buffers
+static pool_buffer_t pool[NET_NETWORK_POOL_SIZE];
+// Buffer which holds the received packet in buffer_in
+static uint8_t pool_current = NETWORK_POOL_NONE;
+// Queue of received packets waiting to be handled
+static uint8_t pool_queue[NET_NETWORK_POOL_SIZE];
+static uint8_t pool_queue_head;
+static uint8_t pool_queue_count;
+
+// Pool statistics
+uint8_t  network_pool_used;
+uint8_t  network_pool_used_max;
+uint16_t network_pool_exhausted;
+// Did the last allocation find no free buffer?
+static uint8_t pool_full;
+
+// Buffer for recieved packets, points into the pool
+uint8_t *buffer_in = pool[0].data;
+#else
 // Buffer for recieved packets
 uint8_t buffer_in[BUFFER_IN_SIZE+1];
+#endif // NET_NETWORK_POOL
+#ifndef NET_NETWORK_SHARED_BUFFER
 // Buffer for packets to transmit
 uint8_t buffer_out[BUFFER_OUT_SIZE];
+#endif // NET_NETWORK_SHARED_BUFFER
 // Length of received packet
 uint16_t buffer_in_length;
+// Length of received packet in the receive buffer of the chip
+uint16_t network_packet_length;
 
 // Functions
 // ---------
@@ -83,8 +239,28 @@ void    write_phy(uint8_t address, uint16_t data);
 
 // Helpers
 void     set_bank(uint8_t address);
+uint8_t  read_status(void);
+void     link_poll(void);
+void     link_update(void);
+void     tx_reserve(void);
+void     tx_load(uint8_t *buffer, uint16_t length);
+#ifdef NET_NETWORK_MULTICAST
+uint8_t  multicast_bucket(uint8_t *mac);
+#endif // NET_NETWORK_MULTICAST
+#ifdef NET_NETWORK_INTERRUPT
+uint8_t  interrupt_poll_due(void);
+#endif // NET_NETWORK_INTERRUPT
+#ifdef NET_NETWORK_INTERRUPT_LATENCY
+uint16_t interrupt_latency(void);
+#ifdef UTILS_COUNTER_TIMER1
+uint16_t latency_time(uint8_t *tick, uint16_t *second);
+#endif // UTILS_COUNTER_TIMER1
+#endif // NET_NETWORK_INTERRUPT_LATENCY
+uint16_t tx_slot(uint8_t slot);
+void     set_read_pointer(uint16_t address);
 uint8_t  get_revision(void);
 uint16_t network_receive(void);
+void     network_release(void);
 
 //
 // Read / write registers
@@ -133,17 +309,10 @@ void read_buffer(uint16_t length, uint8_t *buffer) {
     // Issue read command
     SPDR = NETWORK_READ_BUF_MEM;
     SPI_WAIT();
-    // While length available, read buffer
-    while (length) {
-        length--;
-        // Read buffer
-        SPDR = 0x00;
-        SPI_WAIT();
-        *buffer = (SPDR);
-        buffer++;
-    }
+    // Read buffer in a single burst
+    spi_read_block(buffer, length);
     // Ensure null terminator
-    *buffer = '\0';
+    buffer[length] = '\0';
     // Release spi
     NETWORK_SPI_PASSIVE();
 }
@@ -154,14 +323,8 @@ void write_buffer(uint16_t length, uint8_t *buffer) {
     // Issue write command
     SPDR = NETWORK_WRITE_BUF_MEM;
     SPI_WAIT();
-    // While length available, write buffer
-    while (length) {
-        length--;
-        // Write data
-        SPDR = *buffer;
-        buffer++;
-        SPI_WAIT();
-    }
+    // Write buffer in a single burst
+    spi_write_block(buffer, length);
     // Release spi
     NETWORK_SPI_PASSIVE();
 }
@@ -230,26 +393,148 @@ void write_phy(uint8_t address, uint16_t data) {
 }
 
 uint8_t network_status(void) {
+    return (link_status);
+}
+
+uint8_t read_status(void) {
     uint8_t status = read_phy_high(PHSTAT2) << 2;
     status |= (read_phy_low(PHSTAT2) >> 5) & 0x01;
     status |= read_phy_low(PHSTAT1);
     return status;
 }
 
+void link_poll(void) {
+#ifdef NET_NETWORK_INTERRUPT
+    // The chip pulls the interrupt pin low on a link change
+    if (!NETWORK_INT_ASSERTED()) {
+        return;
+    }
+#endif // NET_NETWORK_INTERRUPT
+    // Did the link change?
+    if (read_op(NETWORK_READ_CTRL_REG, EIR) & EIR_LINKIF) {
+        link_update();
+    }
+}
+
+void link_update(void) {
+    uint8_t previous = link_status;
+    uint8_t i = 0;
+
+    // Reading PHIR clears the link change interrupt
+    read_phy_low(PHIR);
+    // Cache the new status
+    link_status = read_status();
+
+    // Tell the listeners when the link went up or down
+    if ((previous ^ link_status) & NETWORK_STATUS_LSTAT) {
+        while (i < NET_NETWORK_LINK_LISTENERS) {
+            if (link_listeners[i]) {
+                link_listeners[i](network_is_link_up());
+            }
+            i++;
+        }
+    }
+}
+
+uint8_t network_link_register(void (*callback)(uint8_t up)) {
+    uint8_t i = 0;
+
+    // Find an empty spot
+    while (i < NET_NETWORK_LINK_LISTENERS) {
+        if (link_listeners[i] == 0 || link_listeners[i] == callback) {
+            link_listeners[i] = callback;
+            return (1);
+        }
+        i++;
+    }
+    return (0);
+}
+
+void network_link_unregister(void (*callback)(uint8_t up)) {
+    uint8_t i = 0;
+
+    while (i < NET_NETWORK_LINK_LISTENERS) {
+        if (link_listeners[i] == callback) {
+            link_listeners[i] = 0;
+        }
+        i++;
+    }
+}
+
 //
 // Helpers
 //
 
 void set_bank(uint8_t address) {
+    uint8_t bits;
     // Change bank address when needed
     if ((address & BANK_MASK) != bank) {
+        // Only clear bank bits that are set and not needed anymore
+        bits = (bank & ~address) & BANK_MASK;
+        if (bits) {
+            write_op(NETWORK_BIT_FIELD_CLR, ECON1, (bits >> 5));
+        }
+        // Only set bank bits that are needed and not set yet
+        bits = (address & ~bank) & BANK_MASK;
+        if (bits) {
+            write_op(NETWORK_BIT_FIELD_SET, ECON1, (bits >> 5));
+        }
         // Change bank
         bank = (address & BANK_MASK);
-        write_op(NETWORK_BIT_FIELD_CLR, ECON1, (ECON1_BSEL1 | ECON1_BSEL0));
-        write_op(NETWORK_BIT_FIELD_SET, ECON1, (bank >> 5));
     }
 }
 
+void set_read_pointer(uint16_t address) {
+    // Write the low byte only when it changed
+    if ((address & 0xFF) != (read_ptr & 0xFF)) {
+        write(ERDPTL, address & 0xFF);
+    }
+    // Write the high byte only when it changed
+    if ((address >> 8) != (read_ptr >> 8)) {
+        write(ERDPTH, address >> 8);
+    }
+    read_ptr = address;
+}
+
+void network_set_duplex(uint8_t full) {
+    uint8_t receiving;
+    uint8_t reg;
+
+    // Stop receiving while the mac is changed
+    receiving = read_op(NETWORK_READ_CTRL_REG, ECON1) & ECON1_RXEN;
+    write_op(NETWORK_BIT_FIELD_CLR, ECON1, ECON1_RXEN);
+
+    if (full) {
+        // Mac full-duplex, phy has to match
+        // See datasheet p. 36, chap. 6.5
+        // Bit field operations only work on ETH registers
+        reg = read(MACON3);
+        write(MACON3, reg | MACON3_FULDPX);
+        // Set inter-frame gap (back-to-back)
+        write(MABBIPG, 0x15); // Full-duplex value
+        // Phy full-duplex
+        write_phy(PHCON1, PHCON1_PDPXMD);
+    } else {
+        // Mac half-duplex
+        reg = read(MACON3);
+        write(MACON3, reg & (0xFF ^ MACON3_FULDPX));
+        // Set inter-frame gap (back-to-back)
+        write(MABBIPG, 0x12); // Half-duplex value
+        // Set inter-frame gap (non back-to-back), only used in half-duplex
+        write(MAIPGH, 0x0C);
+        // Phy half-duplex
+        write_phy(PHCON1, 0x0000);
+    }
+
+    // Continue receiving
+    if (receiving) {
+        write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_RXEN);
+    }
+
+    // Duplex status changed
+    link_status = read_status();
+}
+
 uint8_t get_revision(void) {
     uint8_t revision;
     revision = read(EREVID);
@@ -263,8 +548,8 @@ uint8_t get_revision(void) {
 }
 
 uint8_t network_is_link_up(void) {
-    // bit 10 (3rd bit in upper register)
-    if (read_phy_high(PHSTAT2) & 0x04) {
+    // Link status of the last link change
+    if (link_status & NETWORK_STATUS_LSTAT) {
         return (1);
     }
     return (0);
@@ -298,10 +583,12 @@ void network_init(void) {
     // Spi config
     // - Enable
     // - Master role
+    // - Clock rate, F_CPU / 2 (SPI2X) when double speed is enabled
     spi_config_t spi_config;
     spi_get_default_config(&spi_config);
     spi_config.enable = SPI_ENABLE;
     spi_config.role = SPI_ROLE_MASTER;
+    spi_config.clock_rate = NETWORK_SPI_CLOCK_RATE;
     spi_init(&spi_config);
 
     // Tick debug for spi init
@@ -333,6 +620,8 @@ void network_init(void) {
 
     // Set receive buffer start address
     next_packet_ptr = RXSTART_INIT;
+    // Read pointer is unknown after a reset, make sure it is written
+    read_ptr = ~next_packet_ptr;
 
     // Rx start
     write(ERXSTL, RXSTART_INIT & 0xFF);
@@ -357,6 +646,9 @@ void network_init(void) {
     write(ERXFCON,
           ERXFCON_UCEN   // Unicast enabled, only accept matching local mac
         | ERXFCON_CRCEN  // Check CRC post filter
+#ifdef NET_NETWORK_MULTICAST
+        | ERXFCON_HTEN   // Hash table filter for joined multicast addresses
+#endif // NET_NETWORK_MULTICAST
         | ERXFCON_PMEN); // Enable packet pattern match filter
 
     // The packet pattern match filter allows arp broadcast packets
@@ -397,17 +689,19 @@ void network_init(void) {
     // No options of macon4 should be used
     write(MACON4, 0x00);
 
-    // Set inter-frame gap (back-to-back)
-    write(MABBIPG, 0x12); // Half-duplex value
-
     // Set inter-frame gap (non back-to-back)
     write(MAIPGL, 0x12);
-    write(MAIPGH, 0x0C);
+
+    // Set duplex mode of mac and phy with the matching inter-frame gaps
+#ifdef NET_NETWORK_FULL_DUPLEX
+    network_set_duplex(1);
+#else
+    network_set_duplex(0);
+#endif // NET_NETWORK_FULL_DUPLEX
 
     // Set the maximum packet size which the chip will accept
-    // Do not recieve packets larger than BUFFER_IN_SIZE
-    write(MAMXFLL, BUFFER_IN_SIZE & 0xFF);
-    write(MAMXFLH, BUFFER_IN_SIZE >> 8);
+    write(MAMXFLL, NETWORK_MAX_RECEIVE & 0xFF);
+    write(MAMXFLH, NETWORK_MAX_RECEIVE >> 8);
 
     // Tick debug for bank 2
     debug_dot();
@@ -440,6 +734,13 @@ void network_init(void) {
     // Led a = link status, led b = receive/transmit => 0x476
     write_phy(PHLCON, 0x476);
 
+    // Interrupt on link changes
+    write_phy(PHIE,
+          PHIE_PGEIE   // Global phy interrupt enable
+        | PHIE_PLNKIE); // Link change interrupt enable
+    // Clear pending phy interrupts and cache the status
+    link_update();
+
     // Tick debug for phy
     debug_dot();
 
@@ -451,12 +752,22 @@ void network_init(void) {
 
     // Enable interrupts
     write_op(NETWORK_BIT_FIELD_SET, EIE,
-          EIE_INTIE   // Global interrupt enable
-        | EIE_PKTIE); // Receive packet pending interrupt enable
+          EIE_INTIE    // Global interrupt enable
+        | EIE_PKTIE    // Receive packet pending interrupt enable
+        | EIE_LINKIE); // Link change interrupt enable
 
     // Enable packet reception
     write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_RXEN); // Receive enable
 
+#ifdef NET_NETWORK_INTERRUPT
+    // Interrupt pin as input
+    NETWORK_INT_DDR &= ~(1 << NETWORK_CTR_INT);
+    // Interrupt on falling edge of INT2, wakes the CPU from idle sleep
+    EICRA = (EICRA & ~(1 << ISC20)) | (1 << ISC21);
+    EIFR = (1 << INTF2);
+    EIMSK |= (1 << INT2);
+#endif // NET_NETWORK_INTERRUPT
+
     // Disable clock output
     write(ECOCON, 0x00);
 
@@ -472,6 +783,10 @@ void network_init(void) {
     // Init arp
     arp_init();
 #endif // NET_ARP
+#ifdef NET_IGMP
+    // Init igmp
+    igmp_init();
+#endif // NET_IGMP
 #if defined(NET_UDP) && defined(NET_UDP_SERVER)
     // Init udp
     udp_server_init();
@@ -491,15 +806,35 @@ void network_init(void) {
     uint8_t result = 0;
     while (result == 0) {
         network_receive();
+        // Wait for the link to come up
+        link_poll();
         result = dhcp_request_ip();
     }
     info_string_p(PSTR("DHCP: IP: "));
     info_ip(my_ip);
     info_newline();
 #endif // NET_DHCP
+#ifdef NET_ARP
+    // Let the network know the address is in use
+    arp_announce();
+#endif // NET_ARP
 }
 
 void network_backbone(void) {
+    // Start the next queued packet when the previous one is sent
+    network_tx_poll();
+#ifdef NET_ARP
+    // Retry unanswered address requests
+    arp_poll();
+#endif // NET_ARP
+#ifdef NET_IGMP
+    // Send delayed membership reports
+    igmp_poll();
+#endif // NET_IGMP
+#if defined(NET_TCP) && defined(NET_TCP_SERVER)
+    // Send delayed acknowledgements
+    tcp_poll();
+#endif // NET_TCP && NET_TCP_SERVER
     // Check if there is a packet available
     network_receive();
 #if defined(NET_DHCP) && !defined(NET_DHCP_NO_RENEWAL)
@@ -508,6 +843,8 @@ void network_backbone(void) {
 #endif // NET_DHCP && !NET_DHCP_NO_RENEWAL
     // If there is no buffer_in_length, there is no packet
     if (buffer_in_length == 0) {
+        // Check for link changes while idle
+        link_poll();
         return;
     }
     // Handle protocols
@@ -527,6 +864,14 @@ void network_backbone(void) {
     else if (buffer_in_length > 33 // Minimum size of IP packet
         && buffer_in[ETH_PTR_TYPE_H] == ETH_VAL_TYPE_IP_H
         && buffer_in[ETH_PTR_TYPE_L] == ETH_VAL_TYPE_IP_L) {
+        // Drop broken packets before they reach a service
+        if (!ip_validate()) {
+            return;
+        }
+#ifdef NET_ARP_SNOOP
+        // Remember the address of the sender
+        arp_snoop();
+#endif // NET_ARP_SNOOP
         // Optimizing trick
         if (0) {}
 #ifdef NET_ICMP
@@ -535,6 +880,12 @@ void network_backbone(void) {
             icmp_packet_receive();
         }
 #endif // NET_ICMP
+#ifdef NET_IGMP
+        // Check if packet is IGMP packet
+        else if (buffer_in_length && buffer_in[IP_PTR_PROTOCOL] == IP_VAL_PROTO_IGMP) {
+            igmp_receive();
+        }
+#endif // NET_IGMP
 #if defined(NET_UDP) && defined(NET_UDP_SERVER)
         // Check if packet is UDP packet
         else if (buffer_in_length && buffer_in[IP_PTR_PROTOCOL] == IP_VAL_PROTO_UDP) {
@@ -550,32 +901,136 @@ void network_backbone(void) {
 }
 
 void network_send(uint16_t length) {
-    // Check if there is a transmission in progress
-    while (read_op(NETWORK_READ_CTRL_REG, ECON1) & ECON1_TXRTS) {
-        // Reset the transmission logic problem.
-        // See revision B4 silicon errata point 12
+    // Load packet into the transmit buffer
+    network_tx_load(length);
+    // Queue the packet for sending onto the network
+    network_tx_send(length);
+}
+
+void network_send_buffer(uint8_t *buffer, uint16_t length) {
+    // Load packet into the transmit buffer
+    tx_load(buffer, length);
+    // Queue the packet for sending onto the network
+    network_tx_send(length);
+}
+
+uint8_t network_send_async(uint16_t length) {
+    // Check for finished transmissions
+    network_tx_poll();
+    // Is there a free slot?
+    if (tx_count == NET_NETWORK_TX_SLOTS) {
+        return (0);
+    }
+    // Load and queue the packet
+    network_send(length);
+    return (1);
+}
+
+void network_tx_poll(void) {
+    uint16_t address;
+
+    // Is the packet in tx_head being transmitted?
+    if (tx_busy) {
+        // Reset the transmission logic after an error, it may not clear
+        // TXRTS. See revision B4 silicon errata point 12
         if (read_op(NETWORK_READ_CTRL_REG, EIR) & EIR_TXERIF) {
             write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_TXRST);
             write_op(NETWORK_BIT_FIELD_CLR, ECON1, ECON1_TXRST);
+            write_op(NETWORK_BIT_FIELD_CLR, EIR, EIR_TXERIF);
+            // Send the packet once more, drop it when that fails as well
+            if (!tx_retried) {
+                tx_retried = 1;
+                write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+                return;
+            }
+            debug_string_p(PSTR("NETWORK: transmit error\r\n"));
+            write_op(NETWORK_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
+        }
+        // Still transmitting?
+        if (read_op(NETWORK_READ_CTRL_REG, ECON1) & ECON1_TXRTS) {
+            return;
+        }
+        // Transmission done, free the slot
+        tx_busy = 0;
+        tx_retried = 0;
+        tx_count--;
+        tx_head++;
+        if (tx_head == NET_NETWORK_TX_SLOTS) {
+            tx_head = 0;
         }
     }
 
-    // Set the write pointer to the start of the transmit buffer area
-    write(EWRPTL, TXSTART_INIT & 0xFF);
-    write(EWRPTH, TXSTART_INIT >> 8);
+    // Is there a packet waiting?
+    if (tx_count == 0) {
+        return;
+    }
 
-    // Set the TXND pointer to correspond the packet size given
-    write(ETXNDL, (TXSTART_INIT + length) & 0xFF);
-    write(ETXNDH, (TXSTART_INIT + length) >> 8);
+    // Set the TXST and TXND pointers to the packet in tx_head
+    address = tx_slot(tx_head);
+    write(ETXSTL, address & 0xFF);
+    write(ETXSTH, address >> 8);
+    address += tx_length[tx_head];
+    write(ETXNDL, address & 0xFF);
+    write(ETXNDH, address >> 8);
 
-    // Write per-packet control byte (0x00 means use MACON3 settings)
-    write_op(NETWORK_WRITE_BUF_MEM, 0, 0x00);
+    // Send the packet onto the network
+    write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+    tx_busy = 1;
+}
+
+uint16_t tx_slot(uint8_t slot) {
+    // Start address of the slot
+    return (TXSTART_INIT + slot * TX_SLOT_SIZE);
+}
+
+void tx_reserve(void) {
+    // Wait until the slot in tx_tail is free
+    while (tx_count == NET_NETWORK_TX_SLOTS) {
+        network_tx_poll();
+    }
+}
+
+void network_tx_load(uint16_t length) {
+    // Load packet from buffer_out
+    tx_load(buffer_out, length);
+}
+
+void tx_load(uint8_t *buffer, uint16_t length) {
+    uint16_t address;
+
+    // Wait for a free slot
+    tx_reserve();
 
+    // Set the write pointer to the start of the slot
+    address = tx_slot(tx_tail);
+    write(EWRPTL, address & 0xFF);
+    write(EWRPTH, address >> 8);
+
+    // Claim spi
+    NETWORK_SPI_ACTIVE();
+    // Issue write command
+    SPDR = NETWORK_WRITE_BUF_MEM;
+    SPI_WAIT();
+    // Write per-packet control byte (0x00 means use MACON3 settings)
+    SPDR = 0x00;
+    SPI_WAIT();
     // Write data to transmit buffer
-    write_buffer(length, buffer_out);
+    spi_write_block(buffer, length);
+    // Release spi
+    NETWORK_SPI_PASSIVE();
+}
 
-    // Send the packet onto the network
-    write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+void network_tx_send(uint16_t length) {
+    // Queue the packet in tx_tail
+    tx_length[tx_tail] = length;
+    tx_tail++;
+    if (tx_tail == NET_NETWORK_TX_SLOTS) {
+        tx_tail = 0;
+    }
+    tx_count++;
+
+    // Send the packet when the chip is idle
+    network_tx_poll();
 
 #ifdef UTILS_WERKTI
     // Update bytes received
@@ -583,57 +1038,539 @@ void network_send(uint16_t length) {
 #endif // UTILS_WERKTI
 }
 
+void network_tx_write(uint16_t offset, uint16_t length, uint8_t *buffer) {
+    // Skip the per-packet control byte
+    offset += tx_slot(tx_tail) + 1;
+
+    // Set the write pointer to the offset in the packet
+    write(EWRPTL, offset & 0xFF);
+    write(EWRPTH, offset >> 8);
+
+    // Write data to transmit buffer
+    write_buffer(length, buffer);
+}
+
+uint16_t network_tx_load_received(void) {
+    uint16_t address;
+
+    // Is there a packet to copy?
+    if (!packet_pending || network_packet_length == 0) {
+        return (0);
+    }
+
+    // Wait for a free slot
+    tx_reserve();
+
+    // Write per-packet control byte (0x00 means use MACON3 settings)
+    address = tx_slot(tx_tail);
+    write(EWRPTL, address & 0xFF);
+    write(EWRPTH, address >> 8);
+    write_op(NETWORK_WRITE_BUF_MEM, 0, 0x00);
+
+    // Source range in the receive buffer, the DMA wraps at the end of it
+    // See datasheet p. 71, chap. 13.1
+    write(EDMASTL, packet_ptr & 0xFF);
+    write(EDMASTH, packet_ptr >> 8);
+    address = packet_ptr + network_packet_length - 1;
+    if (address > RXSTOP_INIT) {
+        address -= RXSTOP_INIT - RXSTART_INIT + 1;
+    }
+    write(EDMANDL, address & 0xFF);
+    write(EDMANDH, address >> 8);
+
+    // Destination right after the per-packet control byte
+    address = tx_slot(tx_tail) + 1;
+    write(EDMADSTL, address & 0xFF);
+    write(EDMADSTH, address >> 8);
+
+    // Start the DMA in copy mode
+    write_op(NETWORK_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
+    write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_DMAST);
+
+    // Wait until the DMA is done
+    while (read_op(NETWORK_READ_CTRL_REG, ECON1) & ECON1_DMAST)
+        ;
+
+    return (network_packet_length);
+}
+
+uint16_t network_tx_checksum(uint16_t offset, uint16_t length) {
+    uint16_t result;
+    uint8_t receiving;
+
+    // Skip the per-packet control byte
+    offset += tx_slot(tx_tail) + 1;
+
+    // Set the range to calculate the checksum over
+    // See datasheet p. 72, chap. 13.2
+    write(EDMASTL, offset & 0xFF);
+    write(EDMASTH, offset >> 8);
+    offset += length - 1;
+    write(EDMANDL, offset & 0xFF);
+    write(EDMANDH, offset >> 8);
+
+    // A DMA checksum can corrupt packets received meanwhile, on all silicon
+    // revisions (B1 to B7). Stop receiving and let the current packet finish,
+    // see errata. Packets arriving meanwhile are lost, like with a full buffer.
+    receiving = read_op(NETWORK_READ_CTRL_REG, ECON1) & ECON1_RXEN;
+    write_op(NETWORK_BIT_FIELD_CLR, ECON1, ECON1_RXEN);
+    while (read_op(NETWORK_READ_CTRL_REG, ESTAT) & ESTAT_RXBUSY)
+        ;
+
+    // Select checksum calculation and start the DMA
+    write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_CSUMEN);
+    write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_DMAST);
+
+    // Wait until the DMA is done
+    while (read_op(NETWORK_READ_CTRL_REG, ECON1) & ECON1_DMAST)
+        ;
+
+    // Continue receiving
+    if (receiving) {
+        write_op(NETWORK_BIT_FIELD_SET, ECON1, ECON1_RXEN);
+    }
+
+    // Read the checksum
+    result = ((uint16_t)read(EDMACSH)) << 8;
+    result |= read(EDMACSL);
+
+    // Back to copy mode for the DMA
+    write_op(NETWORK_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
+
+    return (result);
+}
+
+void network_tx_begin(uint16_t offset) {
+    uint16_t address;
+
+    // Wait for a free slot
+    tx_reserve();
+
+    // Data is appended after the headers, skip the per-packet control byte
+    address = tx_slot(tx_tail) + 1 + offset;
+    write(EWRPTL, address & 0xFF);
+    write(EWRPTH, address >> 8);
+
+    tx_gather_length = offset;
+    tx_gather_sum = 0;
+}
+
+void network_tx_append(uint8_t *buffer, uint16_t length) {
+    uint16_t i = 0;
+
+    // Do not append beyond the maximum frame size
+    if (length > NETWORK_MAX_FRAME_SIZE - 4 - tx_gather_length) {
+        length = NETWORK_MAX_FRAME_SIZE - 4 - tx_gather_length;
+    }
+
+    // Write data to transmit buffer
+    write_buffer(length, buffer);
+
+    // Add data to the checksum, bytes at even offsets are the high byte
+    while (i < length) {
+        if (tx_gather_length & 0x01) {
+            tx_gather_sum += buffer[i];
+        } else {
+            tx_gather_sum += ((uint16_t)buffer[i]) << 8;
+        }
+        tx_gather_length++;
+        i++;
+    }
+}
+
+void network_tx_append_p(const char *pdata, uint16_t length) {
+    uint8_t data;
+
+    // Do not append beyond the maximum frame size
+    if (length > NETWORK_MAX_FRAME_SIZE - 4 - tx_gather_length) {
+        length = NETWORK_MAX_FRAME_SIZE - 4 - tx_gather_length;
+    }
+
+    // Claim spi
+    NETWORK_SPI_ACTIVE();
+    // Issue write command
+    SPDR = NETWORK_WRITE_BUF_MEM;
+    while (length--) {
+        // Read the next byte while the previous one is sent
+        data = pgm_read_byte(pdata++);
+        if (tx_gather_length & 0x01) {
+            tx_gather_sum += data;
+        } else {
+            tx_gather_sum += ((uint16_t)data) << 8;
+        }
+        tx_gather_length++;
+        SPI_WAIT();
+        SPDR = data;
+    }
+    SPI_WAIT();
+    // Release spi
+    NETWORK_SPI_PASSIVE();
+}
+
+void network_tx_append_cb(uint8_t (*producer)(void), uint16_t length) {
+    uint8_t data;
+
+    // Do not append beyond the maximum frame size
+    if (length > NETWORK_MAX_FRAME_SIZE - 4 - tx_gather_length) {
+        length = NETWORK_MAX_FRAME_SIZE - 4 - tx_gather_length;
+    }
+
+    // Claim spi
+    NETWORK_SPI_ACTIVE();
+    // Issue write command
+    SPDR = NETWORK_WRITE_BUF_MEM;
+    while (length--) {
+        // Produce the next byte while the previous one is sent
+        data = producer();
+        if (tx_gather_length & 0x01) {
+            tx_gather_sum += data;
+        } else {
+            tx_gather_sum += ((uint16_t)data) << 8;
+        }
+        tx_gather_length++;
+        SPI_WAIT();
+        SPDR = data;
+    }
+    SPI_WAIT();
+    // Release spi
+    NETWORK_SPI_PASSIVE();
+}
+
+uint16_t network_tx_length(void) {
+    return (tx_gather_length);
+}
+
+uint16_t network_tx_sum(void) {
+    uint32_t sum = tx_gather_sum;
+
+    // Fold the sum into 16 bits
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ((uint16_t)sum);
+}
+
+void network_tx_commit(uint16_t header_length) {
+    uint16_t address;
+
+    // Write the headers in front of the appended data
+    address = tx_slot(tx_tail);
+    write(EWRPTL, address & 0xFF);
+    write(EWRPTH, address >> 8);
+
+    // Claim spi
+    NETWORK_SPI_ACTIVE();
+    // Issue write command
+    SPDR = NETWORK_WRITE_BUF_MEM;
+    SPI_WAIT();
+    // Write per-packet control byte (0x00 means use MACON3 settings)
+    SPDR = 0x00;
+    SPI_WAIT();
+    // Write headers to transmit buffer
+    spi_write_block(buffer_out, header_length);
+    // Release spi
+    NETWORK_SPI_PASSIVE();
+
+    // Queue the packet for sending
+    network_tx_send(tx_gather_length);
+}
+
 uint16_t network_receive(void) {
+    uint8_t  header[NETWORK_RSV_SIZE];
     uint16_t rxstatus;
     uint16_t length;
 
+#ifdef NET_NETWORK_SPI_STATS
+    // Start counting transactions for this packet
+    uint16_t transactions = network_spi_transactions;
+#endif // NET_NETWORK_SPI_STATS
+
+    // Free the previous packet in the receive buffer
+    network_release();
+
     // Reset buffer length
     buffer_in_length = 0;
+    network_packet_length = 0;
+
+#ifdef NET_NETWORK_POOL
+    // Free the buffer of the previous packet, unless it is held
+    if (pool_current != NETWORK_POOL_NONE) {
+        network_pool_release(pool_current);
+        pool_current = NETWORK_POOL_NONE;
+    }
+
+    // Queued packets are handled first
+    if (pool_queue_count) {
+        pool_current = pool_queue[pool_queue_head];
+        pool_queue_head = (pool_queue_head + 1) % NET_NETWORK_POOL_SIZE;
+        pool_queue_count--;
+        buffer_in = pool[pool_current].data;
+        buffer_in_length = pool[pool_current].length;
+        network_packet_length = buffer_in_length;
+        return (buffer_in_length);
+    }
+#endif // NET_NETWORK_POOL
+
+#ifdef NET_NETWORK_INTERRUPT
+    // No need to ask the chip when it does not signal a pending packet, but
+    // ask now and then anyway: the pin follows PKTIF, which can miss packets
+    // according to the silicon errata
+    if (!NETWORK_INT_ASSERTED() && !interrupt_poll_due()) {
+        return (0);
+    }
+#endif // NET_NETWORK_INTERRUPT
 
     // Check if a packet has been received and buffered
     if (read(EPKTCNT) == 0) {
         return (0);
     }
 
+#ifdef NET_NETWORK_POOL
+    // Get a buffer for the packet, it stays in the chip when all are in use
+    pool_current = network_pool_alloc();
+    if (pool_current == NETWORK_POOL_NONE) {
+        return (0);
+    }
+    buffer_in = pool[pool_current].data;
+#endif // NET_NETWORK_POOL
+
     // Set the read pointer to the start of the received packet
-    write(ERDPTL, (next_packet_ptr & 0xFF));
-    write(ERDPTH, (next_packet_ptr >> 8));
+    set_read_pointer(next_packet_ptr);
 
-    // Read the next packet pointer
-    next_packet_ptr = read_op(NETWORK_READ_BUF_MEM, 0);
-    next_packet_ptr |= ((uint16_t)read_op(NETWORK_READ_BUF_MEM, 0)) << 8;
+    // Packet data starts after the receive status vector
+    packet_ptr = next_packet_ptr + NETWORK_RSV_SIZE;
+    if (packet_ptr > RXSTOP_INIT) {
+        packet_ptr -= RXSTOP_INIT - RXSTART_INIT + 1;
+    }
+
+    // Read the receive status vector and the packet in one transaction
+    NETWORK_SPI_ACTIVE();
+    SPDR = NETWORK_READ_BUF_MEM;
+    SPI_WAIT();
+    spi_read_block(header, NETWORK_RSV_SIZE);
 
-    // Read the packet length
+    // Next packet pointer, packet length and receive status
     // See datasheet p. 43
-    length = read_op(NETWORK_READ_BUF_MEM, 0);
-    length |= ((uint16_t)read_op(NETWORK_READ_BUF_MEM, 0)) << 8;
+    next_packet_ptr = header[0];
+    next_packet_ptr |= ((uint16_t)header[1]) << 8;
+    length = header[2];
+    length |= ((uint16_t)header[3]) << 8;
+    rxstatus = header[4];
+    rxstatus |= ((uint16_t)header[5]) << 8;
+
     // Subtract CRC
     length -= 4;
 
-    // Read receive status
-    // See datasheet p. 43
-    rxstatus = read_op(NETWORK_READ_BUF_MEM, 0);
-    rxstatus |= ((uint16_t)read_op(NETWORK_READ_BUF_MEM, 0)) << 8;
+    // Check CRC and symbol errors
+    // See datasheet p 44, table 7-3
+    if ((rxstatus & 0x80) == 0) {
+        // Check failed, invalid packet
+        length = 0;
+    }
+    network_packet_length = length;
 
     // Limit retrieve length
     if (length > BUFFER_IN_SIZE) {
         length = BUFFER_IN_SIZE;
     }
+    buffer_in_length = length;
 
-    // Check CRC and symbol errors
-    // See datasheet p 44, table 7-3
-    if ((rxstatus & 0x80) == 0) {
-        // Check failed, invalid packet
-        length = 0;
-    } else {
-        // Read packet to buffer
-        read_buffer(length, buffer_in);
+#ifdef NET_NETWORK_LAZY_RECEIVE
+    // Only read the headers, the rest is read on demand
+    if (length > NETWORK_HEADER_SIZE) {
+        length = NETWORK_HEADER_SIZE;
+    }
+    buffer_in_loaded = length;
+#endif // NET_NETWORK_LAZY_RECEIVE
+
+    // Continue reading the packet to buffer
+    spi_read_block(buffer_in, length);
+    NETWORK_SPI_PASSIVE();
+
+#ifdef NET_NETWORK_MULTICAST
+    // The hash table filter does not look at the multicast bit, it also
+    // accepts unicast packets for other hosts which hash to a used bucket
+    if (length >= 6 && !(buffer_in[ETH_PTR_MAC_DST] & 0x01)) {
+        uint8_t i = 0;
+        while (i < 6 && buffer_in[ETH_PTR_MAC_DST + i] == my_mac[i]) {
+            i++;
+        }
+        if (i < 6) {
+            buffer_in_length = 0;
+        }
+    }
+#endif // NET_NETWORK_MULTICAST
+
+    // Keep track of the read pointer, it wraps at the end of the receive buffer
+    read_ptr = packet_ptr + length;
+    if (read_ptr > RXSTOP_INIT) {
+        read_ptr -= RXSTOP_INIT - RXSTART_INIT + 1;
+    }
+
+    // The packet stays in the receive buffer until the next call
+    packet_pending = 1;
+
+    // Set buffer terminator
+    buffer_in[length] = '\0';
+    buffer_in[BUFFER_IN_SIZE] = '\0';
+
+#ifdef NET_NETWORK_POOL
+    // Keep the length with the buffer
+    pool[pool_current].length = buffer_in_length;
+#endif // NET_NETWORK_POOL
+
+#ifdef UTILS_WERKTI
+    // Update bytes received
+    werkti_in += network_packet_length;
+#endif // UTILS_WERKTI
+
+#ifdef NET_NETWORK_INTERRUPT_LATENCY
+    // Time between the falling interrupt pin and reading the packet
+    if (interrupt_stamped) {
+        interrupt_stamped = 0;
+        network_interrupt_latency = interrupt_latency();
+        if (network_interrupt_latency > network_interrupt_latency_max) {
+            network_interrupt_latency_max = network_interrupt_latency;
+        }
+    }
+#endif // NET_NETWORK_INTERRUPT_LATENCY
+
+#ifdef NET_NETWORK_SPI_STATS
+    // Transactions used for this packet
+    network_spi_frame_transactions = network_spi_transactions - transactions;
+#endif // NET_NETWORK_SPI_STATS
+
+    return (buffer_in_length);
+}
+
+#ifdef NET_NETWORK_INTERRUPT
+void network_idle(void) {
+    // Disable interrupts so a falling pin can not be missed before sleeping
+    cli();
+    // Only sleep when no packet is pending or being sent
+    if (!NETWORK_INT_ASSERTED() && !packet_pending && tx_count == 0) {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        // The instruction after sei() is always executed, so a pending
+        // interrupt wakes the CPU right after it went to sleep
+        sei();
+        sleep_cpu();
+        sleep_disable();
     }
+    // Enable interrupts
+    sei();
+}
+
+uint8_t interrupt_poll_due(void) {
+#ifdef UTILS_COUNTER
+    uint16_t now = counter_seconds();
+
+    // Once a second, whatever the tick rate of the counter
+    if (now == interrupt_poll_second) {
+        return (0);
+    }
+    interrupt_poll_second = now;
+    return (1);
+#else
+    // Once per 256 calls
+    interrupt_poll_count++;
+    return (interrupt_poll_count == 0);
+#endif // UTILS_COUNTER
+}
+
+#ifdef NET_NETWORK_INTERRUPT_LATENCY
+#ifdef UTILS_COUNTER_TIMER1
+// Timer 1 value, counter tick and second, call with interrupts disabled
+uint16_t latency_time(uint8_t *tick, uint16_t *second) {
+    uint16_t timer = TCNT1;
+
+    *tick = counter_ticks();
+    *second = counter_seconds();
+    // The timer wrapped, but the compare interrupt is still waiting
+    if ((TIFR1 & (1 << OCF1A)) && timer < (OCR1A >> 1)) {
+        (*tick)++;
+    }
+    return (timer);
+}
+
+uint16_t interrupt_latency(void) {
+    uint8_t tick;
+    uint16_t second;
+    int32_t latency;
+
+    // Read the time and the stamp with interrupts disabled
+    cli();
+    latency = latency_time(&tick, &second);
+    latency -= interrupt_stamp;
+    tick -= interrupt_stamp_tick;
+    second -= interrupt_stamp_second;
+    sei();
+
+    // Counter ticks wrap after 2.56 seconds, longer latencies saturate anyway
+    if (second >= 2) {
+        return (0xFFFF);
+    }
+    // Timer 1 wraps after OCR1A every counter tick
+    latency += (int32_t)tick * (OCR1A + 1);
+    if (latency > 0xFFFF) {
+        return (0xFFFF);
+    }
+    return ((uint16_t)latency);
+}
+#else
+uint16_t interrupt_latency(void) {
+    uint16_t now;
+    uint16_t stamp;
+
+    // Read both timer values with interrupts disabled
+    cli();
+    now = TCNT1;
+    stamp = interrupt_stamp;
+    sei();
+
+    // A timer in CTC mode wraps after OCR1A
+    if (now < stamp && (TCCR1B & (1 << WGM12))) {
+        now += OCR1A + 1;
+    }
+    return (now - stamp);
+}
+#endif // UTILS_COUNTER_TIMER1
+#endif // NET_NETWORK_INTERRUPT_LATENCY
+
+ISR(INT2_vect) {
+#ifdef NET_NETWORK_INTERRUPT_LATENCY
+    // Remember when the first pending packet was signaled
+    if (!interrupt_stamped) {
+#ifdef UTILS_COUNTER_TIMER1
+        uint8_t tick;
+        uint16_t second;
+
+        interrupt_stamp = latency_time(&tick, &second);
+        interrupt_stamp_tick = tick;
+        interrupt_stamp_second = second;
+#else
+        interrupt_stamp = TCNT1;
+#endif // UTILS_COUNTER_TIMER1
+        interrupt_stamped = 1;
+    }
+#endif // NET_NETWORK_INTERRUPT_LATENCY
+    // Nothing else to do, the backbone checks the pin
+}
+#endif // NET_NETWORK_INTERRUPT
+
+void network_release(void) {
+    // Is there a packet to free?
+    if (!packet_pending) {
+        return;
+    }
+    packet_pending = 0;
 
     // Move the RX read pointer to the start of the next new packet
-    // This frees the buffer we just read
+    // This frees the buffer of the packet
     // Errata point 13 revision B4: never write an even address!
     // encNextPacketPtr is always an even address if RXSTOP_INIT is odd
+    // The chip only updates ERXRDPT after the high byte is written, so both
+    // bytes are always written.
     if (next_packet_ptr > RXSTOP_INIT) {
         // RXSTART_INIT is zero, no tests for encNextPacketPtr less than RXSTART_INIT
         write(ERXRDPTL, (RXSTOP_INIT) & 0xFF);
@@ -645,19 +1582,233 @@ uint16_t network_receive(void) {
 
     // Decrease the packet counter to indicate we are done with this packet
     write_op(NETWORK_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+}
 
-    // Set buffer terminator and buffer length
-    buffer_in[BUFFER_IN_SIZE] = '\0';
-    buffer_in_length = length;
+uint16_t network_read(uint16_t offset, uint16_t length, uint8_t *buffer) {
+    uint16_t address;
 
-#ifdef UTILS_WERKTI
-    // Update bytes received
-    werkti_in += length;
-#endif // UTILS_WERKTI
+    // Is there a packet to read from?
+    if (!packet_pending || offset >= network_packet_length) {
+        return (0);
+    }
+
+    // Limit length to the end of the packet
+    if (length > network_packet_length - offset) {
+        length = network_packet_length - offset;
+    }
+
+    // Position in the receive buffer, it wraps at the end
+    address = packet_ptr + offset;
+    if (address > RXSTOP_INIT) {
+        address -= RXSTOP_INIT - RXSTART_INIT + 1;
+    }
+    set_read_pointer(address);
+
+    // Read the requested part
+    NETWORK_SPI_ACTIVE();
+    SPDR = NETWORK_READ_BUF_MEM;
+    SPI_WAIT();
+    spi_read_block(buffer, length);
+    NETWORK_SPI_PASSIVE();
+
+    // Keep track of the read pointer
+    read_ptr = address + length;
+    if (read_ptr > RXSTOP_INIT) {
+        read_ptr -= RXSTOP_INIT - RXSTART_INIT + 1;
+    }
 
     return (length);
 }
 
+#ifdef NET_NETWORK_LAZY_RECEIVE
+void network_fetch(void) {
+    // Load the part of the packet which is not in buffer_in yet
+    if (buffer_in_loaded < buffer_in_length) {
+        network_read(buffer_in_loaded, buffer_in_length - buffer_in_loaded, &buffer_in[buffer_in_loaded]);
+        buffer_in_loaded = buffer_in_length;
+        buffer_in[buffer_in_length] = '\0';
+    }
+}
+#endif // NET_NETWORK_LAZY_RECEIVE
+
+//
+// Packet pool
+//
+
+#ifdef NET_NETWORK_POOL
+uint8_t network_pool_alloc(void) {
+    uint8_t i = 0;
+
+    // Find a free buffer
+    while (i < NET_NETWORK_POOL_SIZE) {
+        if (pool[i].refs == 0) {
+            pool[i].refs = 1;
+            pool[i].length = 0;
+            pool_full = 0;
+            // Update statistics
+            network_pool_used++;
+            if (network_pool_used > network_pool_used_max) {
+                network_pool_used_max = network_pool_used;
+            }
+            return (i);
+        }
+        i++;
+    }
+
+    // All buffers are in use, count when the pool runs out
+    if (!pool_full) {
+        pool_full = 1;
+        network_pool_exhausted++;
+    }
+    return (NETWORK_POOL_NONE);
+}
+
+void network_pool_release(uint8_t handle) {
+    // Is the buffer in use?
+    if (handle >= NET_NETWORK_POOL_SIZE || pool[handle].refs == 0) {
+        return;
+    }
+    pool[handle].refs--;
+    if (pool[handle].refs == 0) {
+        network_pool_used--;
+    }
+}
+
+uint8_t network_hold(void) {
+    // Is there a received packet?
+    if (pool_current == NETWORK_POOL_NONE || buffer_in_length == 0) {
+        return (NETWORK_POOL_NONE);
+    }
+    // The next received packet gets another buffer
+    pool[pool_current].refs++;
+    return (pool_current);
+}
+
+uint8_t network_pool_store(uint16_t length) {
+    uint8_t handle;
+    uint16_t i = 0;
+
+    // Does it fit?
+    if (length > BUFFER_IN_SIZE) {
+        return (NETWORK_POOL_NONE);
+    }
+    handle = network_pool_alloc();
+    if (handle == NETWORK_POOL_NONE) {
+        return (NETWORK_POOL_NONE);
+    }
+
+    // Copy the packet from buffer_out
+    while (i < length) {
+        pool[handle].data[i] = buffer_out[i];
+        i++;
+    }
+    pool[handle].length = length;
+    return (handle);
+}
+
+uint8_t *network_pool_data(uint8_t handle) {
+    return (pool[handle].data);
+}
+
+uint16_t network_pool_length(uint8_t handle) {
+    return (pool[handle].length);
+}
+
+uint8_t network_pool_queue(uint8_t handle) {
+    uint8_t i = 0;
+
+    // Is it a buffer in use and is there room?
+    if (handle >= NET_NETWORK_POOL_SIZE || pool[handle].refs == 0
+        || pool_queue_count >= NET_NETWORK_POOL_SIZE) {
+        return (0);
+    }
+    // A buffer is only queued once
+    while (i < pool_queue_count) {
+        if (pool_queue[(pool_queue_head + i) % NET_NETWORK_POOL_SIZE] == handle) {
+            return (0);
+        }
+        i++;
+    }
+
+    pool_queue[(pool_queue_head + pool_queue_count) % NET_NETWORK_POOL_SIZE] = handle;
+    pool_queue_count++;
+    return (1);
+}
+
+void network_pool_send(uint8_t handle) {
+    // Load the packet and queue it for sending
+    network_send_buffer(pool[handle].data, pool[handle].length);
+    // The packet is in the network chip, the buffer is not needed anymore
+    network_pool_release(handle);
+}
+#endif // NET_NETWORK_POOL
+
+//
+// Multicast
+//
+
+#ifdef NET_NETWORK_MULTICAST
+void network_multicast_join(uint8_t *mac) {
+    uint8_t bucket;
+    uint8_t reg;
+
+    bucket = multicast_bucket(mac);
+    // Set the bit in the hash table for the first address in the bucket
+    if (multicast_buckets[bucket] == 0) {
+        reg = read(EHT0 + (bucket >> 3));
+        reg |= 1 << (bucket & 0x07);
+        write(EHT0 + (bucket >> 3), reg);
+    }
+    multicast_buckets[bucket]++;
+}
+
+void network_multicast_leave(uint8_t *mac) {
+    uint8_t bucket;
+    uint8_t reg;
+
+    bucket = multicast_bucket(mac);
+    // Was the address joined?
+    if (multicast_buckets[bucket] == 0) {
+        return;
+    }
+    multicast_buckets[bucket]--;
+    // Clear the bit in the hash table when the bucket is not used anymore
+    if (multicast_buckets[bucket] == 0) {
+        reg = read(EHT0 + (bucket >> 3));
+        reg &= 0xFF ^ (1 << (bucket & 0x07));
+        write(EHT0 + (bucket >> 3), reg);
+    }
+}
+
+uint8_t multicast_bucket(uint8_t *mac) {
+    uint32_t crc = 0xFFFFFFFF;
+    uint8_t i = 0;
+    uint8_t bit;
+    uint8_t data;
+
+    // CRC-32 of the address as calculated by the network chip, bits are
+    // shifted in least significant bit first
+    // See datasheet p. 50, chap. 8.3
+    while (i < 6) {
+        data = mac[i];
+        bit = 0;
+        while (bit < 8) {
+            if (((crc >> 31) ^ data) & 0x01) {
+                crc = (crc << 1) ^ 0x04C11DB7;
+            } else {
+                crc <<= 1;
+            }
+            data >>= 1;
+            bit++;
+        }
+        i++;
+    }
+
+    // Bits 28:23 of the CRC point to the bit in the hash table
+    return ((crc >> 23) & 0x3F);
+}
+#endif // NET_NETWORK_MULTICAST
+
 //
 // Broadcast settings
 //
@@ -34,10 +34,14 @@
 
 #include <inttypes.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <util/delay.h>
 #include "network_defines.h"
 #include "arp.h"
 #include "icmp.h"
+#include "igmp.h"
 #include "tcp.h"
 #include "udp.h"
 #include "../com/spi.h"
@@ -45,6 +49,12 @@
 #include "../utils/logger.h"
 #include "../utils/werkti.h"
 
+/**
+ * @brief Number of bytes read from a packet on receive with
+ * NET_NETWORK_LAZY_RECEIVE: ethernet, IP and TCP header
+ */
+#define NETWORK_HEADER_SIZE 54
+
 /**
  * @brief Initialization of the network chip, includes setting MAC address (and
  * IP address should be set if DHCP is disabled)
@@ -71,17 +81,53 @@ extern void network_init(void);
  * _buffer_in_length_. If the length is available in a protocol header,
  * use that length to know the actual length of the data block.
  *
+ * @note With NET_NETWORK_LAZY_RECEIVE only the headers of a packet are in
+ * _buffer_in_, call network_fetch() before handling the data of a packet
+ * manually.
+ *
  * @see #network_init(void)
  */
 extern void network_backbone(void);
 
+/**
+ * @brief Switch the network chip between half- and full-duplex
+ *
+ * Sets the duplex mode of the mac and phy and the matching inter-frame gaps.
+ * The chip does not auto-negotiate, the switch port should be set to the same
+ * mode. network_status() reports the mode in DXSTAT.
+ *
+ * @param full One for full-duplex, zero for half-duplex
+ */
+extern void network_set_duplex(uint8_t full);
+
 /**
  * @brief Is the network chip connected to a network?
  *
+ * @note The link status is cached and updated by network_backbone() on a
+ * link change interrupt of the network chip, no SPI traffic is needed.
  * @return One if there is a connection
  */
 extern uint8_t network_is_link_up(void);
 
+/**
+ * @brief Register a callback which is called when the link goes up or down
+ *
+ * The callback is called from network_backbone() with one when the link went
+ * up and zero when it went down.
+ *
+ * @param callback Function to call on a link change
+ * @return One on success, zero when NET_NETWORK_LINK_LISTENERS callbacks are
+ * registered
+ */
+extern uint8_t network_link_register(void (*callback)(uint8_t up));
+
+/**
+ * @brief Remove a callback registered with network_link_register()
+ *
+ * @param callback Function to remove
+ */
+extern void network_link_unregister(void (*callback)(uint8_t up));
+
 /**
  * @brief Return the status of the physical layer
  *
@@ -117,10 +163,23 @@ extern uint8_t network_is_link_up(void);
  * JBSTAT:  Latching jabber status (1 = jabber criterea met, 0 = no jabbering)<br />
  * PLRITY:  Polarity status (1 = TPIN+/- is reversed, 0 = TPIN+/- is correct)<br />
  *
+ * @note The status is read from the phy on start up, on a link change and when
+ * the duplex mode is set. TXSTAT, RXSTAT and COLSTAT show the state at that
+ * moment.
  * @return Bitmask of current status, see description for bitmask
  */
 extern uint8_t network_status(void);
 
+/**
+ * @brief LSTAT bit of network_status()
+ */
+#define NETWORK_STATUS_LSTAT 0x10
+
+/**
+ * @brief DXSTAT bit of network_status()
+ */
+#define NETWORK_STATUS_DXSTAT 0x08
+
 /**
  * @brief Send a packet from _buffer_out_ to the network chip to the
  * connected network
@@ -133,6 +192,149 @@ extern uint8_t network_status(void);
  */
 extern void network_send(uint16_t length);
 
+/**
+ * @brief Send a packet from another buffer than _buffer_out_
+ *
+ * @param buffer Buffer holding the packet, including all headers
+ * @param length The total length of the packet to be send
+ */
+extern void network_send_buffer(uint8_t *buffer, uint16_t length);
+
+/**
+ * @brief Queue a packet from _buffer_out_ for sending without waiting
+ *
+ * The packet is loaded into a free slot of the transmit buffer of the network
+ * chip and sent as soon as the packets queued before it are sent. Queued
+ * packets are started by network_backbone(), so the CPU can build the next
+ * packet while the previous one is on the wire.
+ *
+ * @note network_send() does the same, but waits for a free slot instead of
+ * returning. The number of slots is set by NET_NETWORK_TX_SLOTS.
+ * @param length The total length of the packet to be send
+ * @return One if the packet is queued, zero if all slots are in use
+ */
+extern uint8_t network_send_async(uint16_t length);
+
+/**
+ * @brief Check for sent packets and start the next queued packet
+ *
+ * @note This is called by network_backbone, which should be in your main loop.
+ */
+extern void network_tx_poll(void);
+
+/**
+ * @brief Load a packet from _buffer_out_ into the transmit buffer of the
+ * network chip without sending it
+ *
+ * Waits until a transmit slot is free. The packet can be changed with
+ * network_tx_write() and is queued for sending by network_tx_send().
+ *
+ * @param length The total length of the packet
+ */
+extern void network_tx_load(uint16_t length);
+
+/**
+ * @brief Copy the received packet into the transmit buffer of the network chip
+ *
+ * The DMA of the network chip copies the received packet from the receive
+ * buffer to the transmit buffer, without moving it over SPI. Change it with
+ * network_tx_write() and send it with network_tx_send().
+ *
+ * @return Length of the packet copied, zero if there is no received packet
+ */
+extern uint16_t network_tx_load_received(void);
+
+/**
+ * @brief Queue the loaded packet in the transmit buffer of the network chip
+ * for sending
+ *
+ * @param length The total length of the packet
+ */
+extern void network_tx_send(uint16_t length);
+
+/**
+ * @brief Overwrite part of the packet in the transmit buffer of the network
+ * chip
+ *
+ * @param offset Offset from the start of the ethernet header
+ * @param length Number of bytes to write
+ * @param buffer Bytes to write
+ */
+extern void network_tx_write(uint16_t offset, uint16_t length, uint8_t *buffer);
+
+/**
+ * @brief Calculate a checksum over part of the packet in the transmit buffer
+ * with the DMA of the network chip
+ *
+ * The checksum is calculated like the IP checksum: the one's complement of the
+ * one's complement sum of all 16 bit words. Receiving is paused while the DMA
+ * runs, see the silicon errata.
+ *
+ * @param offset Offset from the start of the ethernet header
+ * @param length Number of bytes to calculate the checksum over
+ * @return Checksum of the range
+ */
+extern uint16_t network_tx_checksum(uint16_t offset, uint16_t length);
+
+/**
+ * @brief Read part of the received packet from the network chip
+ *
+ * The received packet stays in the receive buffer of the network chip until
+ * the next packet is received. This reads any part of it, starting at _offset_
+ * from the start of the ethernet header. Use it for data beyond
+ * _buffer_in_length_ or, with NET_NETWORK_LAZY_RECEIVE, to pull only the part
+ * of the data you need.
+ *
+ * @param offset Offset from the start of the ethernet header
+ * @param length Number of bytes to read
+ * @param buffer Buffer to read the bytes into
+ * @return Number of bytes read, limited to the end of the packet
+ */
+extern uint16_t network_read(uint16_t offset, uint16_t length, uint8_t *buffer);
+
+#ifdef NET_NETWORK_LAZY_RECEIVE
+
+/**
+ * @brief Load the rest of the received packet into _buffer_in_
+ *
+ * With NET_NETWORK_LAZY_RECEIVE only the first NETWORK_HEADER_SIZE bytes of a
+ * packet are read into _buffer_in_. Handlers call this when they need the
+ * data, up to _buffer_in_length_, in _buffer_in_ as well.
+ */
+extern void network_fetch(void);
+
+#else
+
+// The complete packet is always read
+#define network_fetch() do {} while (0)
+
+#endif // NET_NETWORK_LAZY_RECEIVE
+
+#ifdef NET_NETWORK_MULTICAST
+
+/**
+ * @brief Receive packets sent to a multicast MAC address
+ *
+ * Sets the bit of the address in the hash table filter of the network chip.
+ * The filter works on buckets, packets for other multicast addresses which
+ * hash to the same bucket are received as well.
+ *
+ * @param mac Multicast MAC address, 6 bytes
+ */
+extern void network_multicast_join(uint8_t *mac);
+
+/**
+ * @brief Stop receiving packets sent to a multicast MAC address
+ *
+ * The bit in the hash table is only cleared when no other joined address
+ * uses the same bucket.
+ *
+ * @param mac Multicast MAC address, 6 bytes, previously joined
+ */
+extern void network_multicast_leave(uint8_t *mac);
+
+#endif // NET_NETWORK_MULTICAST
+
 /**
  * @brief Enable broadcast packets on the network chip
  */
@@ -149,8 +351,22 @@ extern void network_broadcast_disable(void);
  * This buffer contains a received packet. It holds the complete packet and not
  * just the data. This includes the ethernet header.
  */
+#ifdef NET_NETWORK_POOL
+extern uint8_t *buffer_in;
+#else
 extern uint8_t buffer_in[];
+#endif // NET_NETWORK_POOL
 
+#ifdef NET_NETWORK_SHARED_BUFFER
+/**
+ * @brief Transmit packet buffer, shares its memory with _buffer_in_
+ *
+ * Replies are built in place over the received packet. A packet built for
+ * transmission overwrites the received packet, read what you need from
+ * _buffer_in_ before preparing a packet.
+ */
+#define buffer_out buffer_in
+#else
 /**
  * @brief Transmit packet buffer
  *
@@ -158,6 +374,7 @@ extern uint8_t buffer_in[];
  * whole packet including ethernet header.
  */
 extern uint8_t buffer_out[];
+#endif // NET_NETWORK_SHARED_BUFFER
 
 /**
  * @brief Length of the received packet
@@ -172,5 +389,228 @@ extern uint8_t buffer_out[];
  */
 extern uint16_t buffer_in_length;
 
+/**
+ * @brief Length of the received packet in the network chip
+ *
+ * Total length of the received packet, including the ethernet header. Unlike
+ * _buffer_in_length_ this is not limited to BUFFER_IN_SIZE, the remainder can
+ * be read with network_read().
+ */
+extern uint16_t network_packet_length;
+
+/**
+ * @brief Start gathering a packet in the transmit buffer of the network chip
+ *
+ * Data appended with network_tx_append(), network_tx_append_p() and
+ * network_tx_append_cb() is written straight into the memory of the network
+ * chip, after room for the headers. When the headers in _buffer_out_ are
+ * complete, network_tx_commit() writes them in front of the data and sends the
+ * packet. The data does not have to fit in _buffer_out_.
+ *
+ * @param offset Length of the headers, the data starts at this offset
+ */
+extern void network_tx_begin(uint16_t offset);
+
+/**
+ * @brief Append data from RAM to the gathered packet
+ *
+ * @note Data beyond the maximum ethernet frame size is dropped.
+ * @param buffer Data to append
+ * @param length Length of the data
+ */
+extern void network_tx_append(uint8_t *buffer, uint16_t length);
+
+/**
+ * @brief Append data from PROGMEM to the gathered packet
+ *
+ * @param pdata Data in PROGMEM to append
+ * @param length Length of the data
+ */
+extern void network_tx_append_p(const char *pdata, uint16_t length);
+
+/**
+ * @brief Append data from a producer to the gathered packet
+ *
+ * The producer is called for every byte, while the previous byte is sent to
+ * the network chip.
+ *
+ * @param producer Function returning the next byte to append
+ * @param length Number of bytes to append
+ */
+extern void network_tx_append_cb(uint8_t (*producer)(void), uint16_t length);
+
+/**
+ * @brief Length of the gathered packet, headers included
+ */
+extern uint16_t network_tx_length(void);
+
+/**
+ * @brief One's complement sum of the appended data, not complemented
+ *
+ * Can be added to the checksum of the headers to get the protocol checksum.
+ * The headers should have an even length.
+ */
+extern uint16_t network_tx_sum(void);
+
+/**
+ * @brief Write the headers from _buffer_out_ in front of the gathered data and
+ * queue the packet for sending
+ *
+ * @param header_length Length of the headers, as given to network_tx_begin()
+ */
+extern void network_tx_commit(uint16_t header_length);
+
+#ifdef NET_NETWORK_POOL
+
+/**
+ * @brief Handle of no pool buffer
+ */
+#define NETWORK_POOL_NONE 0xFF
+
+/**
+ * @brief Keep the received packet in _buffer_in_ after it is handled
+ *
+ * Received packets are read into a pool of NET_NETWORK_POOL_SIZE buffers. The
+ * buffer of a held packet is not reused until it is released with
+ * network_pool_release(), the next packet is received in another buffer.
+ *
+ * @return Handle of the buffer, NETWORK_POOL_NONE when there is no packet
+ */
+extern uint8_t network_hold(void);
+
+/**
+ * @brief Take a free buffer from the pool
+ *
+ * @return Handle of the buffer, NETWORK_POOL_NONE when all are in use
+ */
+extern uint8_t network_pool_alloc(void);
+
+/**
+ * @brief Drop a reference to a pool buffer, it is free when no references
+ * are left
+ *
+ * @param handle Handle of the buffer
+ */
+extern void network_pool_release(uint8_t handle);
+
+/**
+ * @brief Copy a packet from _buffer_out_ into a pool buffer
+ *
+ * The packet can be sent later with network_pool_send().
+ *
+ * @param length Length of the packet
+ * @return Handle of the buffer, NETWORK_POOL_NONE when all are in use or the
+ * packet does not fit
+ */
+extern uint8_t network_pool_store(uint16_t length);
+
+/**
+ * @brief Data of a pool buffer
+ *
+ * @param handle Handle of the buffer
+ * @return Pointer to the packet in the buffer
+ */
+extern uint8_t *network_pool_data(uint8_t handle);
+
+/**
+ * @brief Length of the packet in a pool buffer
+ *
+ * @param handle Handle of the buffer
+ */
+extern uint16_t network_pool_length(uint8_t handle);
+
+/**
+ * @brief Put a held packet back in the receive queue
+ *
+ * Queued packets are handled by network_backbone() before new packets are
+ * read from the network chip. The reference of the caller is handed over to
+ * the queue. A buffer which is queued already is refused, the caller keeps
+ * its reference then.
+ *
+ * @param handle Handle of the buffer
+ * @return 1 if the buffer is queued, 0 if it is refused
+ */
+extern uint8_t network_pool_queue(uint8_t handle);
+
+/**
+ * @brief Send the packet in a pool buffer
+ *
+ * The reference of the caller is released after the packet is loaded in the
+ * network chip.
+ *
+ * @param handle Handle of the buffer
+ */
+extern void network_pool_send(uint8_t handle);
+
+/**
+ * @brief Number of pool buffers in use
+ */
+extern uint8_t network_pool_used;
+
+/**
+ * @brief Largest number of pool buffers in use since start up
+ */
+extern uint8_t network_pool_used_max;
+
+/**
+ * @brief Number of times the pool ran out of free buffers
+ */
+extern uint16_t network_pool_exhausted;
+
+#endif // NET_NETWORK_POOL
+
+#ifdef NET_NETWORK_INTERRUPT
+
+/**
+ * @brief Put the CPU in idle sleep until something happens
+ *
+ * Returns right away when a packet is pending or a packet is being sent.
+ * Otherwise the CPU sleeps until an interrupt, like the network chip
+ * signaling a received packet or a timer tick. Call it in your main loop after
+ * network_backbone().
+ */
+extern void network_idle(void);
+
+#endif // NET_NETWORK_INTERRUPT
+
+#ifdef NET_NETWORK_INTERRUPT_LATENCY
+
+/**
+ * @brief Timer 1 ticks between the interrupt of the last packet and reading
+ * it from the network chip
+ *
+ * Only packets which arrive while no other packet is pending are measured.
+ * With UTILS_COUNTER_TIMER1 a tick is 3.2 us at 20 MHz, latencies of 0xFFFF
+ * ticks (about 210 ms) and longer read 0xFFFF. Without it only latencies up
+ * to one period of timer 1 are measured.
+ */
+extern uint16_t network_interrupt_latency;
+
+/**
+ * @brief Largest value of network_interrupt_latency since start up
+ */
+extern uint16_t network_interrupt_latency_max;
+
+#endif // NET_NETWORK_INTERRUPT_LATENCY
+
+#ifdef NET_NETWORK_SPI_STATS
+
+/**
+ * @brief Number of SPI transactions with the network chip since start up
+ *
+ * Every time the chip select is claimed counts as one transaction.
+ */
+extern uint16_t network_spi_transactions;
+
+/**
+ * @brief Number of SPI transactions used to receive the last packet
+ *
+ * This includes checking for a pending packet, setting the read pointer,
+ * reading the packet and freeing it in the receive buffer.
+ */
+extern uint8_t network_spi_frame_transactions;
+
+#endif // NET_NETWORK_SPI_STATS
+
 #endif // NET_NETWORK
 #endif // NET_NETWORK_H
@@ -232,6 +232,14 @@
 #define PHCON2_JABBER    0x0400
 #define PHCON2_HDLDIS    0x0100
 
+// PHY PHIE register
+#define PHIE_PLNKIE      0x0010
+#define PHIE_PGEIE       0x0002
+
+// PHY PHIR register
+#define PHIR_PLNKIF      0x0010
+#define PHIR_PGIF        0x0004
+
 // Packet control
 #define PKTCTRL_PHUGEEN  0x08
 #define PKTCTRL_PPADEN   0x04
@@ -255,14 +263,22 @@
 #define NETWORK_CLK_063Mhz 0x4 // Div by 4
 #define NETWORK_CLK_031Mhz 0x5 // Div by 8
 
+// Number of frames the transmit buffer can hold
+#ifndef NET_NETWORK_TX_SLOTS
+#define NET_NETWORK_TX_SLOTS 1
+#endif // NET_NETWORK_TX_SLOTS
+// Size of a transmit slot, holds the per-packet control byte, a full ethernet
+// frame (~1500 bytes) and the transmit status vector written by the chip
+#define TX_SLOT_SIZE 0x0600
+
 // RXSTART_INIT must be zero.
 // See revision B4 sillicon errata point 5
 // Buffer boundries applied to internal 8K ram
 // The entire buffer space will be allocated
 #define RXSTART_INIT 0x0
 // Receive buffer end, must be odd
-#define RXSTOP_INIT  (0x1FFF - 0x0600)
-// Start of TX buffer after RXSTART_INIT with space for one full ethernet frame (~1500 bytes)
-#define TXSTART_INIT (0x1FFF - 0x0600 + 1)
+#define RXSTOP_INIT  (0x1FFF - NET_NETWORK_TX_SLOTS * TX_SLOT_SIZE)
+// Start of TX buffer after RXSTART_INIT with space for NET_NETWORK_TX_SLOTS frames
+#define TXSTART_INIT (0x1FFF - NET_NETWORK_TX_SLOTS * TX_SLOT_SIZE + 1)
 // End of TX buffer at end of memory
 #define TXSTOP_INIT  0x1FFF
@@ -16,12 +16,66 @@
 // Identifier used in IP protocol header
 volatile uint8_t id_nr = 0x05;
 
+// Number of received packets dropped, per IP_DROP_* reason
+uint16_t ip_drops[IP_DROP_REASONS];
+
+#ifdef NET_ARP
+#ifndef NET_IP_DESTINATIONS
+#error NET_IP_DESTINATIONS not defined, but NET_ARP active
+#endif // NET_IP_DESTINATIONS
+
+// Definition of a destination cache entry
+typedef struct {
+    uint8_t ip[4];
+    // ARP cache slot of the next hop
+    uint8_t slot;
+} ip_destination_t;
+
+// Destinations sent to recently, valid for arp_generation destination_generation
+ip_destination_t destinations[NET_IP_DESTINATIONS];
+// Number of valid destinations
+uint8_t destination_count = 0;
+// Next destination to replace
+uint8_t destination_index = 0;
+// ARP cache generation of the destinations
+uint8_t destination_generation = 0;
+// MAC address of a broadcast or multicast destination
+uint8_t destination_mac[6];
+// ARP cache slot of the last routed MAC address
+uint8_t ip_route_slot;
+// Next hop of the packet in buffer_out when its MAC address is unknown
+uint8_t next_hop[4];
+// Is the MAC address of the packet in buffer_out unknown?
+uint8_t next_hop_pending = 0;
+#else
+// Without ARP a packet to route can only go to everyone
+uint8_t broadcast_mac[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+#endif // NET_ARP
+
 // Functions
 // ---------
 
+uint8_t ip_check(void);
+#ifdef NET_ARP
+uint8_t is_broadcast(uint8_t *dst_ip);
+#endif // NET_ARP
+
 void ip_prepare(uint8_t protocol, uint8_t *dst_ip, uint8_t *dst_mac) {
     uint8_t i = 0;
 
+#ifdef NET_ARP
+    // Route the packet when no MAC address is given
+    next_hop_pending = 0;
+    if (dst_mac == 0) {
+        dst_mac = ip_route(dst_ip);
+    }
+#else
+    // Nothing to route with, send to everyone
+    if (dst_mac == 0) {
+        dst_mac = broadcast_mac;
+    }
+#endif // NET_ARP
+
     // Construct ethernet frame
     // ------------------------
     // See The Ethernet, p. 26, chap. 6.2
@@ -51,6 +105,7 @@ void ip_prepare(uint8_t protocol, uint8_t *dst_ip, uint8_t *dst_mac) {
     buffer_out[IP_PTR_LENGTH_H] = 0;
     buffer_out[IP_PTR_LENGTH_L] = 0;
     // Identification: use ipIdentification
+    buffer_out[IP_PTR_ID_H] = 0;
     buffer_out[IP_PTR_ID_L] = id_nr;
     id_nr++;
     // Flags: "Don't Fragment", "Last Fragment" (010), fragment offset 0
@@ -73,10 +128,259 @@ void ip_prepare(uint8_t protocol, uint8_t *dst_ip, uint8_t *dst_mac) {
     }
 }
 
+#ifdef NET_ARP
+uint8_t *ip_route(uint8_t *dst_ip) {
+    uint8_t i = 0;
+    uint8_t slot;
+    uint8_t *hop = dst_ip;
+
+    ip_route_slot = NET_ARP_CACHE_SIZE;
+    // Slots in the destinations are no longer valid when the ARP cache changed
+    if (destination_generation != arp_generation) {
+        destination_generation = arp_generation;
+        destination_count = 0;
+    }
+
+    // Sent to the destination before?
+    while (i < destination_count) {
+        if (destinations[i].ip[0] == dst_ip[0]
+            && destinations[i].ip[1] == dst_ip[1]
+            && destinations[i].ip[2] == dst_ip[2]
+            && destinations[i].ip[3] == dst_ip[3]) {
+            ip_route_slot = destinations[i].slot;
+            return arp_cache_use(ip_route_slot);
+        }
+        i++;
+    }
+
+    // Broadcast goes to everyone
+    if (is_broadcast(dst_ip)) {
+        i = 0;
+        while (i < 6) {
+            destination_mac[i] = 0xFF;
+            i++;
+        }
+        return destination_mac;
+    }
+
+    // Multicast has a fixed MAC address, see RFC 1112, p. 13, chap. 6.4
+    if ((dst_ip[0] & 0xF0) == 0xE0) {
+        destination_mac[0] = 0x01;
+        destination_mac[1] = 0x00;
+        destination_mac[2] = 0x5E;
+        destination_mac[3] = dst_ip[1] & 0x7F;
+        destination_mac[4] = dst_ip[2];
+        destination_mac[5] = dst_ip[3];
+        return destination_mac;
+    }
+
+    // Destinations outside my subnet are reached through the gateway
+    i = 0;
+    while (i < 4) {
+        if ((dst_ip[i] ^ my_ip[i]) & gateway_netmask[i]) {
+            hop = gateway_ip;
+            // A configured gateway MAC address needs no resolving
+            if (gateway_mac[0] | gateway_mac[1] | gateway_mac[2]
+                | gateway_mac[3] | gateway_mac[4] | gateway_mac[5]) {
+                return gateway_mac;
+            }
+            break;
+        }
+        i++;
+    }
+
+    // Is the MAC address of the next hop known?
+    slot = arp_cache_find(hop);
+    if (slot < NET_ARP_CACHE_SIZE) {
+        // Remember the destination
+        i = 0;
+        while (i < 4) {
+            destinations[destination_index].ip[i] = dst_ip[i];
+            i++;
+        }
+        destinations[destination_index].slot = slot;
+        destination_index++;
+        destination_index %= NET_IP_DESTINATIONS;
+        if (destination_count < NET_IP_DESTINATIONS) {
+            destination_count++;
+        }
+        ip_route_slot = slot;
+        return arp_cache_use(slot);
+    }
+
+    // Resolve the next hop, the packet is sent when the answer arrives
+    i = 0;
+    while (i < 4) {
+        next_hop[i] = hop[i];
+        i++;
+    }
+    next_hop_pending = 1;
+    arp_request_mac(next_hop);
+
+    // Placeholder until the MAC address is known
+    i = 0;
+    while (i < 6) {
+        destination_mac[i] = 0;
+        i++;
+    }
+    return destination_mac;
+}
+
+// Is the address the limited broadcast or the broadcast of my subnet?
+uint8_t is_broadcast(uint8_t *dst_ip) {
+    uint8_t i = 0;
+
+    if ((dst_ip[0] & dst_ip[1] & dst_ip[2] & dst_ip[3]) == 0xFF) {
+        return (1);
+    }
+    // A host mask has no broadcast address
+    if (gateway_netmask[3] == 0xFF) {
+        return (0);
+    }
+    // All host bits set in my subnet
+    while (i < 4) {
+        if (((dst_ip[i] ^ my_ip[i]) & gateway_netmask[i])
+            || (dst_ip[i] | gateway_netmask[i]) != 0xFF) {
+            return (0);
+        }
+        i++;
+    }
+    return (1);
+}
+
+uint8_t ip_resolved(void) {
+    return !next_hop_pending;
+}
+
+void ip_discard(void) {
+    next_hop_pending = 0;
+}
+#endif // NET_ARP
+
+uint8_t ip_send(uint16_t length) {
+#ifdef NET_ARP
+    // Wait for the MAC address of the next hop
+    if (next_hop_pending) {
+        next_hop_pending = 0;
+        return (arp_send(next_hop, length) != ARP_DROPPED);
+    }
+#endif // NET_ARP
+    network_send(length);
+    return (1);
+}
+
+// Returns the reason to drop the packet in buffer_in, or IP_DROP_NONE
+uint8_t ip_check(void) {
+    uint16_t length, header;
+
+    // Version 4 with a header of at least 5 words
+    header = (buffer_in[IP_PTR_HEADER_LEN] & 0x0F) << 2;
+    if ((buffer_in[IP_PTR_HEADER_LEN] & 0xF0) != 0x40 || header < IP_LEN_HEADER) {
+        return (IP_DROP_HEADER);
+    }
+    // Only IGMP packets are read with options, for others the header is fixed
+    if (header != IP_LEN_HEADER && buffer_in[IP_PTR_PROTOCOL] != IP_VAL_PROTO_IGMP) {
+        return (IP_DROP_HEADER);
+    }
+
+    // The packet should fit in what is received, buffer_in may hold only
+    // the start of it
+    length = ((uint16_t)buffer_in[IP_PTR_LENGTH_H] << 8) | buffer_in[IP_PTR_LENGTH_L];
+    if (length < header || ETH_LEN_HEADER + length > network_packet_length) {
+        return (IP_DROP_LENGTH);
+    }
+    // Cut off ethernet padding
+    if (ETH_LEN_HEADER + length < buffer_in_length) {
+        buffer_in_length = ETH_LEN_HEADER + length;
+    }
+
+    // Fragments are not put back together, drop them
+    if ((buffer_in[IP_PTR_FLAGS] & 0x3F) || buffer_in[IP_PTR_FRAGMENT_L]) {
+        return (IP_DROP_FRAGMENT);
+    }
+
+    // Options may reach past the headers loaded with NET_NETWORK_LAZY_RECEIVE,
+    // load them before the header is summed
+    if (ETH_LEN_HEADER + header > NETWORK_HEADER_SIZE) {
+        network_fetch();
+    }
+
+#ifndef NET_IP_SKIP_CHECKSUM
+    // The sum over a correct header is all ones
+    if (checksum_add(0, &buffer_in[IP_PTR], header) != 0xFFFF) {
+        return (IP_DROP_CHECKSUM);
+    }
+#endif // NET_IP_SKIP_CHECKSUM
+
+    // UDP and TCP handlers take their lengths from the headers and read the
+    // data from buffer_in, the whole packet should be in it. Only the ICMP
+    // echo reply copies packets larger than buffer_in in the network chip.
+    if ((buffer_in[IP_PTR_PROTOCOL] == IP_VAL_PROTO_UDP
+         || buffer_in[IP_PTR_PROTOCOL] == IP_VAL_PROTO_TCP)
+        && ETH_LEN_HEADER + length > buffer_in_length) {
+        return (IP_DROP_LENGTH);
+    }
+
+    // Segment length
+    length -= header;
+
+#ifdef NET_UDP
+    if (buffer_in[IP_PTR_PROTOCOL] == IP_VAL_PROTO_UDP) {
+        // The UDP length should match the segment
+        header = ((uint16_t)buffer_in[UDP_PTR_LENGTH_H] << 8) | buffer_in[UDP_PTR_LENGTH_L];
+        if (length < UDP_LEN_HEADER || header != length) {
+            return (IP_DROP_LENGTH);
+        }
+#ifndef NET_UDP_SKIP_CHECKSUM
+        // A checksum of zero is not calculated by the sender
+        if (buffer_in[UDP_PTR_CHECKSUM_H] | buffer_in[UDP_PTR_CHECKSUM_L]) {
+            // The data is summed as well, load it
+            network_fetch();
+            if (checksum(&buffer_in[IP_PTR_SRC], 8 + length, CHK_UDP) != 0) {
+                return (IP_DROP_UDP_CHECKSUM);
+            }
+        }
+#endif // NET_UDP_SKIP_CHECKSUM
+    }
+#endif // NET_UDP
+
+#ifdef NET_TCP
+    if (buffer_in[IP_PTR_PROTOCOL] == IP_VAL_PROTO_TCP) {
+        // The TCP header should fit in the segment
+        header = (buffer_in[TCP_PTR_DATA_OFFSET] >> 4) << 2;
+        if (length < TCP_LEN_HEADER || header < TCP_LEN_HEADER || header > length) {
+            return (IP_DROP_LENGTH);
+        }
+#ifndef NET_TCP_SKIP_CHECKSUM
+        // The data is summed as well, load it
+        network_fetch();
+        if (checksum(&buffer_in[IP_PTR_SRC], 8 + length, CHK_TCP) != 0) {
+            return (IP_DROP_TCP_CHECKSUM);
+        }
+#endif // NET_TCP_SKIP_CHECKSUM
+    }
+#endif // NET_TCP
+
+    return (IP_DROP_NONE);
+}
+
+uint8_t ip_validate(void) {
+    uint8_t reason = ip_check();
+
+    if (reason == IP_DROP_NONE) {
+        return (1);
+    }
+
+    // Count the reason and drop the packet
+    ip_drops[reason]++;
+    buffer_in_length = 0;
+    return (0);
+}
+
 // Calculate checksum of packages
 // Set the checksum fields to 0 before running the checksum
 uint16_t checksum(uint8_t *buffer, uint16_t length, uint8_t type) {
-    uint32_t sum = 0;
+    uint16_t sum = 0;
 
     // Add protocol value and length
     switch (type) {
@@ -84,36 +388,96 @@ uint16_t checksum(uint8_t *buffer, uint16_t length, uint8_t type) {
             break;
         case CHK_UDP:
             // Add protocol value: 17 (UDP)
-            sum += IP_VAL_PROTO_UDP;
             // Add UDP length: length - IP source and destination
-            sum += length - 8;
+            sum = IP_VAL_PROTO_UDP + length - 8;
             break;
         case CHK_TCP:
             // Add protocol value: 6
-            sum += IP_VAL_PROTO_TCP;
             // Add TCP length: length - IP source and destination
-            sum += length - 8;
+            sum = IP_VAL_PROTO_TCP + length - 8;
             break;
     }
 
+    // Return 1's complement
+    return (checksum_add(sum, buffer, length) ^ 0xFFFF);
+}
+
+// Add the buffer in 16 bits words to a 1's complement sum
+uint16_t checksum_add(uint16_t sum, uint8_t *buffer, uint16_t length) {
+#ifdef __AVR__
+    uint16_t words = length >> 1;
+    uint8_t high, low;
+
+    // Add the words with carry, the carry out of the high byte is added to
+    // the low byte again (end around carry). This can not carry out again.
+    if (words) {
+        asm volatile (
+            "1:"                            "\n\t"
+            "ld   %[high], %a[buffer]+"     "\n\t"
+            "ld   %[low], %a[buffer]+"      "\n\t"
+            "add  %A[sum], %[low]"          "\n\t"
+            "adc  %B[sum], %[high]"         "\n\t"
+            "adc  %A[sum], __zero_reg__"    "\n\t"
+            "adc  %B[sum], __zero_reg__"    "\n\t"
+            "sbiw %[words], 1"              "\n\t"
+            "brne 1b"                       "\n\t"
+            : [sum] "+r" (sum), [buffer] "+e" (buffer), [words] "+w" (words),
+              [high] "=&r" (high), [low] "=&r" (low)
+            :
+            // The buffer is read, pending stores to it have to be done first
+            : "memory"
+        );
+    }
+
+    // If there is a byte left, add it with padding
+    if (length & 1) {
+        asm volatile (
+            "add  %B[sum], %[high]"         "\n\t"
+            "adc  %A[sum], __zero_reg__"    "\n\t"
+            "adc  %B[sum], __zero_reg__"    "\n\t"
+            : [sum] "+r" (sum)
+            : [high] "r" (*buffer)
+        );
+    }
+
+    return sum;
+#else
+    // Reference version for other compilers
+    uint32_t total = sum;
+
     // Process the buffer for length in 16 bits words
     while (length > 1) {
-        sum += 0xFFFF & ((((uint32_t)*buffer) << 8) | *(buffer + 1));
+        total += ((uint16_t)buffer[0] << 8) | buffer[1];
         buffer += 2;
         length -= 2;
     }
 
     // If there is a byte left, add it with padding
     if (length) {
-        sum += ((uint32_t)(0xFF & *buffer)) << 8;
+        total += (uint16_t)buffer[0] << 8;
     }
 
     // If the sum is over 16 bits, calculate the sum over the bytes until the
     // result is a 16 bits word
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    while (total >> 16) {
+        total = (total & 0xFFFF) + (total >> 16);
     }
 
+    return (uint16_t)total;
+#endif // __AVR__
+}
+
+// Incremental update of a checksum, see RFC 1624, p. 4, eqn. 3
+uint16_t checksum_update(uint16_t check, uint16_t old_value, uint16_t new_value) {
+    // HC' = ~(~HC + ~m + m')
+    uint32_t sum = (uint16_t)~check;
+    sum += (uint16_t)~old_value;
+    sum += new_value;
+
+    // Fold the carries back in
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
     // Return 1's complement
     return ((uint16_t)sum ^ 0xFFFF);
 }
@@ -133,4 +497,70 @@ void add_value_to_buffer(uint16_t value, uint8_t *buff, uint8_t size) {
     }
 }
 
+// Checksum of the headers in buffer_out and the data gathered in the chip
+uint16_t checksum_gather(uint16_t header_length, uint8_t type) {
+    uint32_t sum;
+
+    // Sum of the IP source and destination address and the protocol header
+    sum = (uint16_t)~checksum(&buffer_out[IP_PTR_SRC], header_length - IP_PTR_SRC, CHK_IP);
+    // Sum of the gathered data
+    sum += network_tx_sum();
+
+    // Add pseudo header protocol value and segment length
+    sum += network_tx_length() - ETH_LEN_HEADER - IP_LEN_HEADER;
+    if (type == CHK_UDP) {
+        sum += IP_VAL_PROTO_UDP;
+    } else {
+        sum += IP_VAL_PROTO_TCP;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    // Return 1's complement
+    return ((uint16_t)sum ^ 0xFFFF);
+}
+
+#ifdef NET_NETWORK_CHECKSUM_OFFLOAD
+
+// Let the network chip calculate the protocol checksum
+void checksum_offload_send(uint16_t length, uint8_t type) {
+    uint32_t sum;
+    uint16_t offset;
+    uint8_t value[2];
+
+    // Load the packet into the network chip
+    network_tx_load(length);
+
+    // Checksum over source and destination address and the segment
+    sum = (uint16_t)~network_tx_checksum(IP_PTR_SRC, length - IP_PTR_SRC);
+
+    // Add pseudo header protocol value and segment length
+    sum += length - ETH_LEN_HEADER - IP_LEN_HEADER;
+    if (type == CHK_UDP) {
+        sum += IP_VAL_PROTO_UDP;
+        offset = UDP_PTR_CHECKSUM_H;
+    } else {
+        sum += IP_VAL_PROTO_TCP;
+        offset = TCP_PTR_CHECKSUM_H;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    sum ^= 0xFFFF;
+
+    // A calculated UDP checksum of zero is transmitted as all ones
+    if (type == CHK_UDP && sum == 0) {
+        sum = 0xFFFF;
+    }
+
+    // Patch the checksum into the packet and send it
+    value[0] = sum >> 8;
+    value[1] = sum & 0xFF;
+    network_tx_write(offset, 2, value);
+    network_tx_send(length);
+}
+
+#endif // NET_NETWORK_CHECKSUM_OFFLOAD
+
 #endif // NET_NETWORK
@@ -20,6 +20,12 @@
 
 #include <inttypes.h>
 #include "network.h"
+#include "arp.h"
+
+/**
+ * @brief Identification of the next IP packet
+ */
+extern volatile uint8_t id_nr;
 
 /**
  * @brief Prepare an ETH and IP header in bufferOut
@@ -29,13 +35,87 @@
  * type, version, type of service (ToS), identification, flags, time to live
  * (TTL), protocol and source and destination IP addresses.
  *
+ * With NET_ARP a zero <i>dst_mac</i> routes the packet, see ip_route(). It
+ * should then be sent with ip_send(). Without NET_ARP there is nothing to
+ * route with, and a zero <i>dst_mac</i> sends the packet to everyone.
+ *
  * @param protocol Protocol to be used, see RFC 1700, p. 8, PROTOCOL NUMBERS
  * @param dst_ip IP address of the destination
- * @param dst_mac MAC address of the destination
+ * @param dst_mac MAC address of the destination, zero to route (NET_ARP)
  * @see #udp_prepare(uint16_t, uint8_t*, uint16_t, uint8_t*)
  * @see #udp_prepare_reply(void)
  */
 extern void ip_prepare(uint8_t protocol, uint8_t *dst_ip, uint8_t *dst_mac);
+
+#ifdef NET_ARP
+/**
+ * @brief Find the MAC address to send a packet for <i>dst_ip</i> to
+ *
+ * Broadcasts, also to the own subnet, and multicasts need no resolving.
+ * Destinations in the own subnet (gateway_netmask) are sent to directly,
+ * others to gateway_ip, or gateway_mac when it is set. The result is kept in a
+ * destination cache of NET_IP_DESTINATIONS entries until the ARP cache
+ * changes. When the next hop is not known, a request is sent and ip_send()
+ * waits for the answer.
+ *
+ * @note Sending a request overwrites <i>buffer_out</i>.
+ * @param dst_ip IP address of the destination
+ * @return Pointer to the MAC address
+ */
+extern uint8_t *ip_route(uint8_t *dst_ip);
+
+/**
+ * @brief ARP cache slot of the MAC address found by the last ip_route(),
+ * NET_ARP_CACHE_SIZE when it did not come from the cache
+ */
+extern uint8_t ip_route_slot;
+
+/**
+ * @brief Returns 1 if the MAC address of the packet in buffer_out is known
+ */
+extern uint8_t ip_resolved(void);
+
+/**
+ * @brief Forget the next hop of the packet in buffer_out
+ *
+ * Call when a packet is not sent with ip_send() while it waits for its next
+ * hop, or when buffer_out is filled without ip_prepare(). Otherwise the next
+ * ip_send() waits for the wrong next hop.
+ */
+extern void ip_discard(void);
+#endif // NET_ARP
+
+/**
+ * @brief Send the IP packet in buffer_out
+ *
+ * A routed packet for a next hop which is being resolved is kept until the
+ * answer arrives, see arp_send().
+ *
+ * @param length Length of the packet
+ * @return 0 if the packet was dropped while its next hop is resolved
+ */
+extern uint8_t ip_send(uint16_t length);
+/**
+ * @brief Check the IP packet in <i>buffer_in</i> before it is handled
+ *
+ * Checks the version, header length, total length and fragment fields, the
+ * header checksum and the UDP or TCP length and checksum. The checksums can be
+ * skipped with NET_IP_SKIP_CHECKSUM, NET_UDP_SKIP_CHECKSUM and
+ * NET_TCP_SKIP_CHECKSUM. UDP and TCP packets which do not fit in
+ * <i>buffer_in</i> are dropped, with NET_NETWORK_LAZY_RECEIVE they are loaded
+ * to verify their checksum. Ethernet padding is cut off <i>buffer_in_length</i>.
+ * A bad packet is counted in ip_drops and <i>buffer_in_length</i> is reset.
+ *
+ * @note Should not be called by users, it is called by network_backbone.
+ * @return 1 if the packet can be handled, 0 if it is dropped
+ */
+extern uint8_t ip_validate(void);
+
+/**
+ * @brief Number of dropped received packets, indexed by IP_DROP_*
+ */
+extern uint16_t ip_drops[];
+
 /**
  * @brief Calculate the checksum of the provided buffer for the provided length
  *
@@ -46,6 +126,32 @@ extern void ip_prepare(uint8_t protocol, uint8_t *dst_ip, uint8_t *dst_mac);
  */
 extern uint16_t checksum(uint8_t *buffer, uint16_t length, uint8_t type);
 
+/**
+ * @brief Add the 16 bits words of a buffer to a 1's complement sum
+ *
+ * Uses an add with carry loop on AVR, a C version on other compilers.
+ *
+ * @param sum Sum to add to, not complemented
+ * @param buffer Pointer to the first byte, the high byte of a word
+ * @param length Number of bytes, an odd last byte is padded with zero
+ * @return Sum of the buffer, not complemented
+ */
+extern uint16_t checksum_add(uint16_t sum, uint8_t *buffer, uint16_t length);
+
+/**
+ * @brief Update a checksum for a changed 16 bits word
+ *
+ * Patches the checksum of a packet where a single word changes, instead of
+ * calculating it over the whole packet. Call once per changed word.
+ *
+ * @param check Checksum as it is in the packet
+ * @param old_value Old value of the word
+ * @param new_value New value of the word
+ * @return Checksum to put in the packet
+ * @see RFC 1624
+ */
+extern uint16_t checksum_update(uint16_t check, uint16_t old_value, uint16_t new_value);
+
 /**
  * @brief Add value to a number in buffer
  *
@@ -55,8 +161,48 @@ extern uint16_t checksum(uint8_t *buffer, uint16_t length, uint8_t type);
  */
 extern void add_value_to_buffer(uint16_t value, uint8_t *buff, uint8_t size);
 
+/**
+ * @brief Calculate the protocol checksum of a packet gathered with
+ * network_tx_begin()
+ *
+ * Adds the checksum of the headers in buffer_out, from the IP source address
+ * up to header_length, to the sum of the data appended in the network chip.
+ *
+ * @param header_length Length of all headers, should be even
+ * @param type Type of packet, CHK_UDP or CHK_TCP
+ * @return Calculated checksum
+ */
+extern uint16_t checksum_gather(uint16_t header_length, uint8_t type);
+
+#ifdef NET_NETWORK_CHECKSUM_OFFLOAD
+
+/**
+ * @brief Send the packet in buffer_out with the protocol checksum calculated by
+ * the network chip
+ *
+ * The IP header checksum should already be set. The packet is loaded into the
+ * transmit buffer of the network chip, the DMA calculates the checksum over
+ * the IP addresses and the segment, the pseudo header protocol and length are
+ * added and the checksum is patched into the packet before it is sent.
+ *
+ * @param length Total length of the packet
+ * @param type Type of packet, CHK_UDP or CHK_TCP
+ */
+extern void checksum_offload_send(uint16_t length, uint8_t type);
+
+#endif // NET_NETWORK_CHECKSUM_OFFLOAD
+
 // Checksum
 // --------------------
+#define IP_DROP_HEADER       0
+#define IP_DROP_LENGTH       1
+#define IP_DROP_FRAGMENT     2
+#define IP_DROP_CHECKSUM     3
+#define IP_DROP_UDP_CHECKSUM 4
+#define IP_DROP_TCP_CHECKSUM 5
+#define IP_DROP_REASONS      6
+#define IP_DROP_NONE         0xFF
+
 #define CHK_IP   0
 #define CHK_ICMP 0
 #define CHK_UDP  1
@@ -129,6 +275,7 @@ extern void add_value_to_buffer(uint16_t value, uint8_t *buff, uint8_t size);
 // Protocol values
 // See RFC 1700, p. 8
 #define IP_VAL_PROTO_ICMP  0x01
+#define IP_VAL_PROTO_IGMP  0x02
 #define IP_VAL_PROTO_TCP   0x06
 #define IP_VAL_PROTO_UDP   0x11
 
@@ -151,6 +298,26 @@ extern void add_value_to_buffer(uint16_t value, uint8_t *buff, uint8_t size);
 #define ICMP_VAL_TYPE_ECHOREQUEST 0x08
 
 
+// IGMP
+// --------------------
+#define IGMP_LEN_HEADER       8
+#define IGMP_LEN_ROUTER_ALERT 4
+
+// Sent packets have the router alert option in the IP header
+#define IGMP_PTR_ROUTER_ALERT 0x22
+#define IGMP_PTR              0x26
+
+// Offsets in the IGMP message, received packets may have other IP options
+#define IGMP_OFF_TYPE      0
+#define IGMP_OFF_MAX_RESP  1
+#define IGMP_OFF_CHECKSUM  2
+#define IGMP_OFF_GROUP     4
+
+#define IGMP_VAL_TYPE_QUERY     0x11
+#define IGMP_VAL_TYPE_REPORT_V1 0x12
+#define IGMP_VAL_TYPE_REPORT    0x16
+#define IGMP_VAL_TYPE_LEAVE     0x17
+
 // UDP
 // --------------------
 #define UDP_LEN_HEADER 8
@@ -183,7 +350,7 @@ extern void add_value_to_buffer(uint16_t value, uint8_t *buff, uint8_t size);
 #define TCP_PTR_URGENT_PTR 0x34
 #define TCP_PTR_OPTIONS    0x36
 #define TCP_PTR_DATA       0x36
-#define TCP_PTR_DATA_OPTS  0x3E
+#define TCP_PTR_DATA_OPTS  0x3A
 
 #define TCP_FLAG_CWR       0b10000000
 #define TCP_FLAG_ECN_ECHO  0b01000000
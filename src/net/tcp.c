@@ -19,31 +19,130 @@
 #error TCP cannot work without NET_NETWORK
 #endif // NET_NETWORK
 
-uint8_t sequence_nr = 1;
+#ifndef NET_TCP_CONNECTIONS
+#error TCP cannot work without NET_TCP_CONNECTIONS defined
+#endif // NET_TCP_CONNECTIONS
+
+#ifdef NET_TCP_ACK_DELAY
+#ifndef UTILS_COUNTER
+#error NET_TCP_ACK_DELAY cannot work without UTILS_COUNTER
+#endif // UTILS_COUNTER
+// Acknowledgements may not be delayed for half a second, see RFC 1122, p. 96
+#if NET_TCP_ACK_DELAY >= 500
+#error NET_TCP_ACK_DELAY should be less than 500 ms
+#endif
+#define TCP_ACK_DELAY_TICKS ((uint8_t)((uint32_t)NET_TCP_ACK_DELAY * COUNTER_TICKS_PER_SECOND / 1000))
+#endif // NET_TCP_ACK_DELAY
+
+#if defined(NET_TCP_IDLE_TIMEOUT) && !defined(UTILS_COUNTER)
+#error NET_TCP_IDLE_TIMEOUT cannot work without UTILS_COUNTER
+#endif // NET_TCP_IDLE_TIMEOUT && !UTILS_COUNTER
+
+#ifdef NET_TCP_RETRANSMIT
+#ifndef UTILS_COUNTER
+#error NET_TCP_RETRANSMIT cannot work without UTILS_COUNTER
+#endif // UTILS_COUNTER
+#define TCP_MS_TO_TICKS(x) ((uint16_t)((uint32_t)(x) * COUNTER_TICKS_PER_SECOND / 1000))
+#define TCP_RTO_INITIAL TCP_MS_TO_TICKS(NET_TCP_RTO_INITIAL)
+#define TCP_RTO_MIN     TCP_MS_TO_TICKS(NET_TCP_RTO_MIN)
+#define TCP_RTO_MAX     TCP_MS_TO_TICKS(NET_TCP_RTO_MAX)
+// The smoothed round trip time is kept x8 in 16 bits
+#if NET_TCP_RTO_MAX * COUNTER_TICKS_PER_SECOND / 1000 > 0x1FFF
+#error NET_TCP_RTO_MAX is too large for the counter ticks
+#endif
+#endif // NET_TCP_RETRANSMIT
+
+// Peers may always send segments of TCP_MSS_DEFAULT, see RFC 1122, p. 85
+#if TCP_MSS_RECEIVE < TCP_MSS_DEFAULT
+#warning BUFFER_IN_SIZE can not hold a segment of TCP_MSS_DEFAULT bytes
+#endif
+
+// Connections, placed from the slot of their hash on
+tcp_connection_t connections[NET_TCP_CONNECTIONS];
+// Connection of the packet being handled or prepared, zero if none
+tcp_connection_t *tcp_current = 0;
+// Counter for initial sequence numbers
+uint16_t isn_count = 0;
+// Number of packets sent, shows if a service replied
+uint8_t tcp_sent;
+// Number of gathered packets dropped while their next hop is resolved
+uint8_t tcp_dropped;
+#if defined(NET_TCP_ACK_DELAY) || defined(NET_TCP_RETRANSMIT) || defined(NET_TCP_IDLE_TIMEOUT)
+// Counter tick of the last tcp_poll
+uint8_t poll_ticks;
+#endif // NET_TCP_ACK_DELAY || NET_TCP_RETRANSMIT || NET_TCP_IDLE_TIMEOUT
+
+void ack_packet(void);
+void reset_packet(void);
+void segment_arrives(tcp_connection_t *con, uint8_t flags, uint32_t seq, uint32_t ack, uint16_t length);
+uint8_t segment_deliver(uint16_t length);
+void segment_sent(uint8_t flags, uint16_t length);
+void stream_send(tcp_connection_t *con);
+void segment_acked(tcp_connection_t *con);
+void segment_resend(tcp_connection_t *con);
+void rtt_update(tcp_connection_t *con, uint16_t rtt);
+uint16_t mss_read(void);
+uint8_t connection_hash(uint8_t *ip, uint16_t remote_port, uint16_t local_port);
+tcp_connection_t *connection_find(uint8_t *ip, uint16_t remote_port, uint16_t local_port);
+tcp_connection_t *connection_new(uint8_t *ip, uint8_t *mac, uint16_t remote_port, uint16_t local_port);
+uint8_t *connection_mac(tcp_connection_t *con);
+void connection_construct(tcp_connection_t *con);
+uint32_t seq_read(uint8_t *buffer);
+void seq_write(uint8_t *buffer, uint32_t value);
+void mac_copy(uint8_t *to, uint8_t *from);
 
 uint8_t *add_syn_options() {
     // Get starting index
     uint8_t *buff = &buffer_out[TCP_PTR_OPTIONS];
     // Options:
-    // Maximum segment size: 1024 (0x400)
-    *buff++ = 0x02;
-    *buff++ = 0x04;
-    *buff++ = 0x04;
-    *buff++ = 0x00;
-    // Nop to fill for next option
-    //buffer_out[TCP_PTR_OPTIONS+4] = 0x01;
-    // Window scale: 0 (no multiplication)
-    *buff++ = 0x03;
-    *buff++ = 0x03;
-    *buff++ = 0x00;
-    // End of option list
-    *buff++ = 0x00;
-    // Update header length (+ 0x02, 2x 4 bytes)
-    buffer_out[TCP_PTR_DATA_OFFSET] += 0x02 << 4;
+    // Maximum segment size, what fits in buffer_in
+    *buff++ = TCP_OPT_MSS;
+    *buff++ = TCP_OPT_MSS_LENGTH;
+    *buff++ = TCP_MSS_RECEIVE >> 8;
+    *buff++ = TCP_MSS_RECEIVE & 0xFF;
+    // Update header length (+ 0x01, 1x 4 bytes)
+    buffer_out[TCP_PTR_DATA_OFFSET] += 0x01 << 4;
     // Return new data start location
     return &buffer_out[TCP_PTR_DATA_OPTS];
 }
 
+// Read the maximum segment size from the options of the SYN in buffer_in,
+// see RFC 879
+uint16_t mss_read(void) {
+    uint16_t mss = TCP_MSS_DEFAULT;
+    uint16_t i = TCP_PTR_OPTIONS;
+    uint16_t end = TCP_PTR_PORT_SRC_H + (buffer_in[TCP_PTR_DATA_OFFSET] >> 4) * 4;
+
+    // Options may not be loaded yet
+    network_fetch();
+    while (i < end && buffer_in[i] != TCP_OPT_END) {
+        // No operation is a single byte
+        if (buffer_in[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        // Other options have a length, stop at a broken one or one which
+        // reaches past the header
+        if (i + 1 >= end || buffer_in[i + 1] < 2 || i + buffer_in[i + 1] > end) {
+            break;
+        }
+        if (buffer_in[i] == TCP_OPT_MSS && buffer_in[i + 1] == TCP_OPT_MSS_LENGTH) {
+            mss = ((uint16_t)buffer_in[i + 2] << 8) | buffer_in[i + 3];
+        }
+        i += buffer_in[i + 1];
+    }
+
+    // A zero size would stall streams, any other size of the peer is kept
+    if (mss == 0) {
+        mss = TCP_MSS_DEFAULT;
+    }
+    // Small enough for buffer_out
+    if (mss > TCP_MSS_SEND) {
+        mss = TCP_MSS_SEND;
+    }
+    return mss;
+}
+
 uint8_t *construct(uint16_t src_port, uint8_t *dst_ip, uint16_t dst_port, uint8_t *dst_mac) {
     // Create IP protocol header
     ip_prepare(IP_VAL_PROTO_TCP, dst_ip, dst_mac);
@@ -59,23 +158,23 @@ uint8_t *construct(uint16_t src_port, uint8_t *dst_ip, uint16_t dst_port, uint8_
     *buff++ = dst_port >> 8;
     *buff++ = dst_port & 0xFF;
     // Sequence number [TCP_PTR_SEQ_NR]
-    *buff++ = 1;
-    *buff++ = 0;
-    *buff++ = 0;
-    *buff++ = sequence_nr++;
     // Acknowledgement number [TCP_PTR_ACK_NR]
-    *buff++ = 0;
-    *buff++ = 0;
-    *buff++ = 0;
-    *buff++ = 0;
+    if (tcp_current) {
+        seq_write(buff, tcp_current->snd_nxt);
+        seq_write(buff + 4, tcp_current->rcv_nxt);
+    } else {
+        seq_write(buff, 0);
+        seq_write(buff + 4, 0);
+    }
+    buff += 8;
     // Header length [TCP_PTR_DATA_OFFSET]
     // Pre options: 5 x 32 bits
     *buff++ = 0x05 << 4;
     // Flags: no flags [TCP_PTR_FLAGS]
     *buff++ = 0;
-    // Window: 1024 bytes max (0x400) [TCP_PTR_WINDOW]
-    *buff++ = 0x04;
-    *buff++ = 0;
+    // Window: one segment, packets are handled one at a time [TCP_PTR_WINDOW]
+    *buff++ = TCP_MSS_RECEIVE >> 8;
+    *buff++ = TCP_MSS_RECEIVE & 0xFF;
     // Checksum: set to 0 [TCP_PTR_CHECKSUM_H]
     *buff++ = 0;
     *buff++ = 0;
@@ -87,6 +186,13 @@ uint8_t *construct(uint16_t src_port, uint8_t *dst_ip, uint16_t dst_port, uint8_
 }
 
 uint8_t *tcp_prepare(uint16_t src_port, uint8_t *dst_ip, uint16_t dst_port, uint8_t *dst_mac) {
+    // Open a connection
+    tcp_current = connection_new(dst_ip, dst_mac, dst_port, src_port);
+    if (tcp_current == 0) {
+        return 0;
+    }
+    tcp_current->state = TCP_STATE_SYN_SENT;
+
     construct(src_port, dst_ip, dst_port, dst_mac);
     tcp_add_flags(TCP_FLAG_SYN);
     return add_syn_options();
@@ -94,6 +200,7 @@ uint8_t *tcp_prepare(uint16_t src_port, uint8_t *dst_ip, uint16_t dst_port, uint
 
 void tcp_send(uint16_t length) {
     uint16_t tmp, len_tcp;
+    uint8_t flags = buffer_out[TCP_PTR_FLAGS];
 
     // TCP packet length
     len_tcp = (buffer_out[TCP_PTR_DATA_OFFSET] >> 4) * 4;
@@ -108,6 +215,24 @@ void tcp_send(uint16_t length) {
     buffer_out[IP_PTR_CHECKSUM_H] = tmp >> 8;
     buffer_out[IP_PTR_CHECKSUM_L] = tmp & 0xFF;
 
+#ifdef NET_NETWORK_CHECKSUM_OFFLOAD
+#ifdef NET_ARP
+    // A packet waiting for its next hop is kept in memory instead
+    if (ip_resolved())
+#endif // NET_ARP
+    {
+        // Update the connection
+        segment_sent(flags, length);
+        tmp = ETH_LEN_HEADER + IP_LEN_HEADER + len_tcp + length;
+#ifdef UTILS_WERKTI_MORE
+        werkti_tcp_out += tmp;
+#endif // UTILS_WERKTI_MORE
+
+        // Send packet to chip, let the chip calculate the TCP checksum
+        checksum_offload_send(tmp, CHK_TCP);
+        return;
+    }
+#endif // NET_NETWORK_CHECKSUM_OFFLOAD
     // Calculate checksum TCP header
     tmp = checksum(&buffer_out[IP_PTR_SRC], 8+len_tcp+length, CHK_TCP);
     buffer_out[TCP_PTR_CHECKSUM_H] = tmp >> 8;
@@ -118,8 +243,250 @@ void tcp_send(uint16_t length) {
     werkti_tcp_out += tmp;
 #endif // UTILS_WERKTI_MORE
 
-    // Send packet to chip
-    network_send(tmp);
+    // Send packet, the connection is only updated when it is not dropped
+    // while the next hop is resolved
+    if (ip_send(tmp)) {
+        segment_sent(flags, length);
+    }
+#ifdef NET_TCP_RETRANSMIT
+    // Send it again once the next hop may be known
+    else if (tcp_current && tcp_current->rto_left == 0) {
+        tcp_current->rto_left = tcp_current->rto;
+    }
+#endif // NET_TCP_RETRANSMIT
+}
+
+void tcp_gather_begin(void) {
+    // Data is appended after the prepared headers
+    network_tx_begin(ETH_LEN_HEADER + IP_LEN_HEADER + (buffer_out[TCP_PTR_DATA_OFFSET] >> 4) * 4);
+}
+
+uint8_t tcp_gather_send(void) {
+    uint16_t tmp, len_header;
+
+    // Length of all headers
+    len_header = ETH_LEN_HEADER + IP_LEN_HEADER + (buffer_out[TCP_PTR_DATA_OFFSET] >> 4) * 4;
+
+    // IP packet length
+    tmp = network_tx_length() - ETH_LEN_HEADER;
+    buffer_out[IP_PTR_LENGTH_H] = tmp >> 8;
+    buffer_out[IP_PTR_LENGTH_L] = tmp & 0xFF;
+
+    // Calculate checksum IP header
+    tmp = checksum(&buffer_out[IP_PTR], IP_LEN_HEADER, CHK_IP);
+    buffer_out[IP_PTR_CHECKSUM_H] = tmp >> 8;
+    buffer_out[IP_PTR_CHECKSUM_L] = tmp & 0xFF;
+
+    // Calculate checksum TCP header and gathered data
+    tmp = checksum_gather(len_header, CHK_TCP);
+    buffer_out[TCP_PTR_CHECKSUM_H] = tmp >> 8;
+    buffer_out[TCP_PTR_CHECKSUM_L] = tmp & 0xFF;
+
+#ifdef UTILS_WERKTI_MORE
+    werkti_tcp_out += network_tx_length();
+#endif // UTILS_WERKTI_MORE
+
+#ifdef NET_ARP
+    // The gathered data can not be kept while the next hop is resolved
+    if (!ip_resolved()) {
+        ip_discard();
+        tcp_dropped++;
+#ifdef NET_TCP_RETRANSMIT
+        // Produce it again once the next hop may be known
+        if (tcp_current && tcp_current->rto_left == 0) {
+            tcp_current->rto_left = tcp_current->rto;
+        }
+#endif // NET_TCP_RETRANSMIT
+        return 0;
+    }
+#endif // NET_ARP
+
+    // Write headers to chip and send packet
+    network_tx_commit(len_header);
+
+    // Update the connection
+    segment_sent(buffer_out[TCP_PTR_FLAGS], network_tx_length() - len_header);
+    return 1;
+}
+
+void segment_sent(uint8_t flags, uint16_t length) {
+    tcp_sent++;
+    if (tcp_current == 0 || (flags & TCP_FLAG_RESET)) {
+        return;
+    }
+#ifdef NET_TCP_ACK_DELAY
+    // The received data is acknowledged
+    if (flags & TCP_FLAG_ACK) {
+        tcp_current->ack_delayed = 0;
+    }
+#endif // NET_TCP_ACK_DELAY
+
+    // SYN and FIN take a sequence number
+    if (flags & TCP_FLAG_SYN) {
+        length++;
+    }
+    if (flags & TCP_FLAG_FIN) {
+        length++;
+        // Closing from our side
+        if (tcp_current->state == TCP_STATE_ESTABLISHED) {
+            tcp_current->state = TCP_STATE_FIN_WAIT_1;
+        } else if (tcp_current->state == TCP_STATE_CLOSE_WAIT) {
+            tcp_current->state = TCP_STATE_LAST_ACK;
+        }
+    }
+    if (length == 0) {
+        return;
+    }
+#ifdef NET_TCP_RETRANSMIT
+    // Wait for the acknowledgement
+    if (tcp_current->rto_left == 0) {
+        tcp_current->rto_left = tcp_current->rto;
+    }
+    // Time a new packet, but not one sent again, see RFC 6298, p. 4
+    if (!tcp_current->rtt_timing && tcp_current->snd_nxt == tcp_current->snd_max) {
+        tcp_current->rtt_timing = 1;
+        tcp_current->rtt_ticks = 0;
+        tcp_current->rtt_seq = tcp_current->snd_nxt + length;
+    }
+#endif // NET_TCP_RETRANSMIT
+    tcp_current->snd_nxt += length;
+    if ((int32_t)(tcp_current->snd_nxt - tcp_current->snd_max) > 0) {
+        tcp_current->snd_max = tcp_current->snd_nxt;
+    }
+}
+
+uint8_t connection_hash(uint8_t *ip, uint16_t remote_port, uint16_t local_port) {
+    return (uint8_t)(ip[3] ^ remote_port ^ (remote_port >> 8) ^ local_port) % NET_TCP_CONNECTIONS;
+}
+
+tcp_connection_t *connection_find(uint8_t *ip, uint16_t remote_port, uint16_t local_port) {
+    uint8_t i = connection_hash(ip, remote_port, local_port);
+    uint8_t j = 0;
+    tcp_connection_t *con;
+
+    // Search from the slot of the hash on
+    while (j < NET_TCP_CONNECTIONS) {
+        con = &connections[i];
+        if (con->state != TCP_STATE_CLOSED
+            && con->remote_port == remote_port
+            && con->local_port == local_port
+            && con->ip[0] == ip[0]
+            && con->ip[1] == ip[1]
+            && con->ip[2] == ip[2]
+            && con->ip[3] == ip[3]) {
+            return con;
+        }
+        i++;
+        i %= NET_TCP_CONNECTIONS;
+        j++;
+    }
+
+    return 0;
+}
+
+tcp_connection_t *connection_new(uint8_t *ip, uint8_t *mac, uint16_t remote_port, uint16_t local_port) {
+    uint8_t i = connection_hash(ip, remote_port, local_port);
+    uint8_t j = 0;
+    tcp_connection_t *con = 0;
+
+    // Take the first closed slot from the slot of the hash on, a connection
+    // in TIME-WAIT otherwise
+    while (j < NET_TCP_CONNECTIONS) {
+        if (connections[i].state == TCP_STATE_CLOSED) {
+            con = &connections[i];
+            break;
+        }
+        if (con == 0 && connections[i].state == TCP_STATE_TIME_WAIT) {
+            con = &connections[i];
+        }
+        i++;
+        i %= NET_TCP_CONNECTIONS;
+        j++;
+    }
+    if (con == 0) {
+        debug_string_p(PSTR("TCP: No free connection\r\n"));
+        return 0;
+    }
+
+    i = 0;
+    while (i < 4) {
+        con->ip[i] = ip[i];
+        i++;
+    }
+    con->remote_port = remote_port;
+    con->local_port = local_port;
+    // Packets sent on a timer go to the MAC address of the peer, buffer_in
+    // holds another packet then
+    i = 0;
+    while (i < 6) {
+        con->mac[i] = mac ? mac[i] : 0;
+        i++;
+    }
+
+    // Initial sequence number, should differ per connection, see RFC 793,
+    // p. 27
+    isn_count++;
+    con->snd_una = ((uint32_t)isn_count << 16) ^ ((uint32_t)my_mac[5] << 24);
+#ifdef UTILS_COUNTER
+    con->snd_una += (uint32_t)counter_seconds() << 8;
+#endif // UTILS_COUNTER
+    con->snd_nxt = con->snd_una;
+    con->snd_max = con->snd_una;
+    con->rcv_nxt = 0;
+    con->mss = TCP_MSS_DEFAULT;
+    con->snd_wnd = 0;
+    con->stream = 0;
+#ifdef NET_TCP_IDLE_TIMEOUT
+    con->seen = counter_seconds();
+#endif // NET_TCP_IDLE_TIMEOUT
+#ifdef NET_TCP_RETRANSMIT
+    con->srtt = 0;
+    con->rttvar = 0;
+    con->rto = TCP_RTO_INITIAL;
+    con->rto_left = 0;
+    con->rtt_timing = 0;
+    con->retries = 0;
+    con->probing = 0;
+#endif // NET_TCP_RETRANSMIT
+#ifdef NET_TCP_ACK_DELAY
+    con->ack_delayed = 0;
+#endif // NET_TCP_ACK_DELAY
+    return con;
+}
+
+uint32_t seq_read(uint8_t *buffer) {
+    return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16)
+        | ((uint16_t)buffer[2] << 8) | buffer[3];
+}
+
+void seq_write(uint8_t *buffer, uint32_t value) {
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+// MAC address to send the packets of a connection to, zero to route
+uint8_t *connection_mac(tcp_connection_t *con) {
+    if (con->mac[0] | con->mac[1] | con->mac[2] | con->mac[3] | con->mac[4] | con->mac[5]) {
+        return con->mac;
+    }
+    return 0;
+}
+
+// Prepare the headers of a packet of a connection from the connection itself,
+// buffer_in may hold another packet or a reply already
+void connection_construct(tcp_connection_t *con) {
+    construct(con->local_port, con->ip, con->remote_port, connection_mac(con));
+}
+
+void mac_copy(uint8_t *to, uint8_t *from) {
+    uint8_t i = 0;
+
+    while (i < 6) {
+        to[i] = from[i];
+        i++;
+    }
 }
 
 // Port services list
@@ -129,7 +496,7 @@ void tcp_send(uint16_t length) {
 #error NET_TCP_SERVICES_LIST_SIZE not defined, but NET_TCP_SERVER active
 #endif // NET_TCP_SERVICES_LIST_SIZE
 // Create port service list
-port_service_t port_services[NET_TCP_SERVICES_LIST_SIZE];
+static port_service_t port_services[NET_TCP_SERVICES_LIST_SIZE];
 
 void tcp_server_init(void) {
     // Prepare port list
@@ -142,110 +509,633 @@ void tcp_receive(void) {
     werkti_tcp_in += buffer_in_length;
     #endif // UTILS_WERKTI_MORE
 
+    uint8_t flags = buffer_in[TCP_PTR_FLAGS];
+    uint16_t remote_port, local_port, length;
+    uint32_t seq, ack;
+    tcp_connection_t *con;
+
     // Notify TCP type
     debug_string_p(PSTR("TCP: "));
-    // Get type
-    uint8_t type = buffer_in[TCP_PTR_FLAGS];
-    // Check if it is a reset request
-    if (type & TCP_FLAG_RESET) {
-        debug_string_p(PSTR("RST "));
-        // Reply request
-        debug_string_p(PSTR("TODO"));
-        debug_newline();
-        // Notify finish
-        //debug_ok();
-        // Do not process request further
-    }
-    // Check if it is a syn request
-    else if (type & TCP_FLAG_SYN) {
-        debug_string_p(PSTR("SYN "));
-        // Prepare reply
-        tcp_prepare_reply();
-        // Add options
-        add_syn_options();
-        // Increase seq with sequence_nr
-        add_value_to_buffer(sequence_nr++, &buffer_out[TCP_PTR_SEQ_NR], 4);
-        // Increase ack with 1
-        add_value_to_buffer(1, &buffer_out[TCP_PTR_ACK_NR], 4);
-        // Set syn and ack flag
-        tcp_add_flags(TCP_FLAG_SYN | TCP_FLAG_ACK);
-        // Send packet
-        tcp_send(0);
-        // Notify finish
-        debug_ok();
-    }
-    // Check if it is a fin request
-    else if (type & TCP_FLAG_FIN) {
-        debug_string_p(PSTR("FIN "));
-        // Prepare reply
-        tcp_prepare_reply();
-        // Increase ack with 1
-        add_value_to_buffer(1, &buffer_out[TCP_PTR_ACK_NR], 4);
-        // Set fin and ack flag
-        tcp_add_flags(TCP_FLAG_FIN | TCP_FLAG_ACK);
-        // Send packet
-        tcp_send(0);
-        // Notify finish
+    debug_number_as_hex(flags);
+    debug_string_p(PSTR(" "));
+
+    // Get ports, sequence and acknowledgement number
+    remote_port = ((uint16_t)buffer_in[TCP_PTR_PORT_SRC_H] << 8) | buffer_in[TCP_PTR_PORT_SRC_L];
+    local_port = ((uint16_t)buffer_in[TCP_PTR_PORT_DST_H] << 8) | buffer_in[TCP_PTR_PORT_DST_L];
+    seq = seq_read(&buffer_in[TCP_PTR_SEQ_NR]);
+    ack = seq_read(&buffer_in[TCP_PTR_ACK_NR]);
+
+    // Length of the data
+    length = ((uint16_t)buffer_in[IP_PTR_LENGTH_H] << 8) | buffer_in[IP_PTR_LENGTH_L];
+    length -= IP_LEN_HEADER + (buffer_in[TCP_PTR_DATA_OFFSET] >> 4) * 4;
+
+    // Find the connection of the packet
+    con = connection_find(&buffer_in[IP_PTR_SRC], remote_port, local_port);
+    tcp_current = con;
+    if (con) {
+        // Keep the address of the peer, replies may overwrite buffer_in
+        segment_arrives(con, flags, seq, ack, length);
+        // The acknowledgement may have opened the window for more of the
+        // stream
+        stream_send(con);
         debug_ok();
+        return;
     }
-    // Check if it a single ack, we do not have to process it
-    else if (type == TCP_FLAG_ACK) {
-        debug_string_p(PSTR("ACK"));
+
+    // No connection, a reset is dropped
+    if (flags & TCP_FLAG_RESET) {
         debug_ok();
+        return;
     }
-    // Check if it is a push request
-    else if (type & TCP_FLAG_PUSH) {
-        debug_string_p(PSTR("PSH "));
-
-        // Prepare variables
-        uint16_t port;
-        void (*callback)(uint8_t *data, uint16_t length);
-
-        // Retrieve port
-        port  = ((uint16_t)buffer_in[TCP_PTR_PORT_DST_H]) << 8;
-        port |= buffer_in[TCP_PTR_PORT_DST_L];
-        debug_number(port);
-        debug_string_p(PSTR(" "));
-
-        // Retrieve length of packet
-        uint16_t pkt_length = ((uint16_t)buffer_in[IP_PTR_LENGTH_H]) << 8;
-        pkt_length |= buffer_in[IP_PTR_LENGTH_L];
-        // Substract IP header length
-        pkt_length -= IP_LEN_HEADER;
-        // Substract TCP header length
-        pkt_length -= (buffer_in[TCP_PTR_DATA_OFFSET] >> 4) * 4;
-        debug_number_as_hex(pkt_length);
-
-        // ACK packet
-        tcp_prepare_reply();
-        // Increase ack with length
-        add_value_to_buffer(pkt_length, &buffer_out[TCP_PTR_ACK_NR], 4);
-        // Set ACK flag
-        tcp_add_flags(TCP_FLAG_ACK);
-        // Send packet
-        tcp_send(0);
-        debug_string_p(PSTR(" ack "));
-
-        // Check if a listener is registered for this port
-        // Add space in front because of number debug before
-        debug_string_p(PSTR("service "));
-        callback = port_service_get(port_services, NET_TCP_SERVICES_LIST_SIZE, port);
-        if (callback) {
+
+    // Open a connection on a SYN to a port with a service
+    if ((flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) == TCP_FLAG_SYN
+        && port_service_get(port_services, NET_TCP_SERVICES_LIST_SIZE, local_port)) {
+        tcp_current = connection_new(&buffer_in[IP_PTR_SRC], &buffer_in[ETH_PTR_MAC_SRC], remote_port, local_port);
+        if (tcp_current) {
+            debug_string_p(PSTR("SYN "));
+            tcp_current->state = TCP_STATE_SYN_RECEIVED;
+            tcp_current->rcv_nxt = seq + 1;
+            tcp_current->snd_wnd = ((uint16_t)buffer_in[TCP_PTR_WINDOW] << 8) | buffer_in[TCP_PTR_WINDOW + 1];
+            tcp_current->mss = mss_read();
+            // Reply with SYN and ACK
+            tcp_prepare_reply();
+            add_syn_options();
+            tcp_add_flags(TCP_FLAG_SYN | TCP_FLAG_ACK);
+            tcp_send(0);
             debug_ok();
-            // Call callback function
-            callback(&buffer_in[buffer_in_length-pkt_length], pkt_length); // Execute callback
+            return;
+        }
+    }
+
+    // Refuse anything else, see RFC 793, p. 36
+    reset_packet();
+    debug_ok();
+}
+
+// Process a packet of a connection, see RFC 793, p. 64, SEGMENT ARRIVES
+void segment_arrives(tcp_connection_t *con, uint8_t flags, uint32_t seq, uint32_t ack, uint16_t length) {
+    // The next hop to the peer may change
+    mac_copy(con->mac, &buffer_in[ETH_PTR_MAC_SRC]);
+
+#ifdef NET_TCP_IDLE_TIMEOUT
+    // The peer is still there
+    con->seen = counter_seconds();
+#endif // NET_TCP_IDLE_TIMEOUT
+
+    // Waiting for a SYN and ACK to our SYN
+    if (con->state == TCP_STATE_SYN_SENT) {
+        // Does it acknowledge our SYN?
+        if ((flags & TCP_FLAG_ACK) && ack != con->snd_max) {
+            if (!(flags & TCP_FLAG_RESET)) {
+                reset_packet();
+            }
+            return;
+        }
+        if (flags & TCP_FLAG_RESET) {
+            if (flags & TCP_FLAG_ACK) {
+                debug_string_p(PSTR("refused "));
+                con->state = TCP_STATE_CLOSED;
+            }
+            return;
+        }
+        if ((flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) == (TCP_FLAG_SYN | TCP_FLAG_ACK)) {
+            con->rcv_nxt = seq + 1;
+            con->snd_una = ack;
+            segment_acked(con);
+            con->snd_wnd = ((uint16_t)buffer_in[TCP_PTR_WINDOW] << 8) | buffer_in[TCP_PTR_WINDOW + 1];
+            con->mss = mss_read();
+            con->state = TCP_STATE_ESTABLISHED;
+            debug_string_p(PSTR("established "));
+            ack_packet();
+        }
+        return;
+    }
+
+    // Only the next expected packet is accepted, the rest is sent again by the
+    // peer after our acknowledgement
+    if (seq != con->rcv_nxt) {
+        // A SYN sent again, our SYN and ACK got lost
+        if ((flags & TCP_FLAG_SYN) && con->state == TCP_STATE_SYN_RECEIVED
+            && seq + 1 == con->rcv_nxt) {
+            debug_string_p(PSTR("SYN again "));
+            con->snd_nxt = con->snd_una;
+            tcp_prepare_reply();
+            add_syn_options();
+            tcp_add_flags(TCP_FLAG_SYN | TCP_FLAG_ACK);
+            tcp_send(0);
+        } else if (!(flags & TCP_FLAG_RESET)) {
+            debug_string_p(PSTR("unexpected "));
+            ack_packet();
+        }
+        return;
+    }
+
+    // Reset by the peer
+    if (flags & TCP_FLAG_RESET) {
+        debug_string_p(PSTR("RST "));
+        con->state = TCP_STATE_CLOSED;
+        return;
+    }
+
+    // A SYN in the window is an error
+    if (flags & TCP_FLAG_SYN) {
+        reset_packet();
+        con->state = TCP_STATE_CLOSED;
+        return;
+    }
+
+    // Every packet after the handshake has an acknowledgement
+    if (!(flags & TCP_FLAG_ACK)) {
+        return;
+    }
+
+    // Acknowledgement of something not sent yet
+    if ((int32_t)(ack - con->snd_max) > 0) {
+        if (con->state == TCP_STATE_SYN_RECEIVED) {
+            reset_packet();
         } else {
-            // Notify error
-            debug_error();
+            ack_packet();
+        }
+        return;
+    }
+    // Acknowledgement of new data
+    if ((int32_t)(ack - con->snd_una) > 0) {
+        con->snd_una = ack;
+        segment_acked(con);
+    }
+    // Window of the peer, only packets in order are taken so it is never
+    // older than the last one, see RFC 793, p. 72
+    con->snd_wnd = ((uint16_t)buffer_in[TCP_PTR_WINDOW] << 8) | buffer_in[TCP_PTR_WINDOW + 1];
+
+    // Is our SYN or FIN acknowledged?
+    switch (con->state) {
+        case TCP_STATE_SYN_RECEIVED:
+            if (con->snd_una == con->snd_max) {
+                debug_string_p(PSTR("established "));
+                con->state = TCP_STATE_ESTABLISHED;
+            }
+            break;
+        case TCP_STATE_FIN_WAIT_1:
+            if (con->snd_una == con->snd_max) {
+                con->state = TCP_STATE_FIN_WAIT_2;
+            }
+            break;
+        case TCP_STATE_CLOSING:
+            if (con->snd_una == con->snd_max) {
+                con->state = TCP_STATE_TIME_WAIT;
+            }
+            break;
+        case TCP_STATE_LAST_ACK:
+            if (con->snd_una == con->snd_max) {
+                debug_string_p(PSTR("closed "));
+                con->state = TCP_STATE_CLOSED;
+                return;
+            }
+            break;
+    }
+
+    // Data is only taken while the peer has not closed
+    if (length && (con->state == TCP_STATE_ESTABLISHED
+        || con->state == TCP_STATE_FIN_WAIT_1 || con->state == TCP_STATE_FIN_WAIT_2)) {
+        con->rcv_nxt += length;
+        // The peer sends the packet again when the reply could not be sent
+        if (!segment_deliver(length)) {
+            return;
+        }
+    } else {
+        length = 0;
+    }
+
+    // The peer closes the connection
+    if (flags & TCP_FLAG_FIN) {
+        debug_string_p(PSTR("FIN "));
+        con->rcv_nxt++;
+        switch (con->state) {
+            case TCP_STATE_SYN_RECEIVED:
+            case TCP_STATE_ESTABLISHED:
+                con->state = TCP_STATE_CLOSE_WAIT;
+                // The stream closes the connection when it ends
+                if (con->stream) {
+                    break;
+                }
+                // Close as well, a reply of the service may have overwritten
+                // buffer_in with NET_NETWORK_SHARED_BUFFER
+                connection_construct(con);
+                tcp_add_flags(TCP_FLAG_FIN | TCP_FLAG_ACK);
+                tcp_send(0);
+                return;
+            case TCP_STATE_FIN_WAIT_1:
+                con->state = (con->snd_una == con->snd_max) ? TCP_STATE_TIME_WAIT : TCP_STATE_CLOSING;
+                break;
+            case TCP_STATE_FIN_WAIT_2:
+                con->state = TCP_STATE_TIME_WAIT;
+                break;
+        }
+        ack_packet();
+    }
+}
+
+// Hand the data of the packet to the service of the port, returns 0 when the
+// data is not taken
+uint8_t segment_deliver(uint16_t length) {
+    void (*callback)(uint8_t *data, uint16_t length);
+    tcp_connection_t *con = tcp_current;
+
+    debug_string_p(PSTR("data "));
+    debug_number(length);
+
+    // Count the packets sent and dropped by the service
+    uint8_t count = tcp_sent;
+    uint8_t dropped = tcp_dropped;
+
+    // Check if a listener is registered for this port
+    debug_string_p(PSTR(" service "));
+    callback = port_service_get(port_services, NET_TCP_SERVICES_LIST_SIZE, con->local_port);
+    if (callback) {
+        // Load the data of the packet
+        network_fetch();
+        // Call callback function
+        callback(&buffer_in[buffer_in_length - length], length);
+    } else {
+        // Notify error
+        debug_error();
+    }
+    // The service may have prepared packets of other connections
+    tcp_current = con;
+
+    // The reply of the service carried the ACK
+    if (count != tcp_sent) {
+        return 1;
+    }
+    // A reply gathered without a stream can not be produced again when it is
+    // dropped for its next hop. Do not acknowledge the data, the peer sends it
+    // again and the service replies once the next hop is known.
+    if (dropped != tcp_dropped && con->stream == 0) {
+        debug_string_p(PSTR(" no next hop "));
+        con->rcv_nxt -= length;
+        return 0;
+    }
+#ifdef NET_TCP_ACK_DELAY
+    // Wait for more data, every second packet is acknowledged right away, see
+    // RFC 1122, p. 96
+    if (!con->ack_delayed) {
+        con->ack_delayed = 1;
+        con->ack_time = counter_ticks();
+        con->ack_second = counter_seconds();
+        return 1;
+    }
+#endif // NET_TCP_ACK_DELAY
+    // ACK packet
+    ack_packet();
+    return 1;
+}
+
+void ack_packet(void) {
+    // ACK packet, the addresses and numbers come from the connection
+    connection_construct(tcp_current);
+    // Set ACK flag
+    tcp_add_flags(TCP_FLAG_ACK);
+    // Send packet
+    tcp_send(0);
+    debug_string_p(PSTR(" ack "));
+}
+
+void reset_packet(void) {
+    uint8_t flags = buffer_in[TCP_PTR_FLAGS];
+    uint32_t seq = seq_read(&buffer_in[TCP_PTR_SEQ_NR]);
+    uint32_t ack = seq_read(&buffer_in[TCP_PTR_ACK_NR]);
+    uint16_t length;
+
+    // Length of the packet in sequence numbers
+    length = ((uint16_t)buffer_in[IP_PTR_LENGTH_H] << 8) | buffer_in[IP_PTR_LENGTH_L];
+    length -= IP_LEN_HEADER + (buffer_in[TCP_PTR_DATA_OFFSET] >> 4) * 4;
+    if (flags & TCP_FLAG_SYN) {
+        length++;
+    }
+    if (flags & TCP_FLAG_FIN) {
+        length++;
+    }
+
+    // Not part of a connection
+    tcp_current = 0;
+    tcp_prepare_reply();
+    debug_string_p(PSTR("reset "));
+
+    // See RFC 793, p. 65
+    if (flags & TCP_FLAG_ACK) {
+        seq_write(&buffer_out[TCP_PTR_SEQ_NR], ack);
+        tcp_add_flags(TCP_FLAG_RESET);
+    } else {
+        seq_write(&buffer_out[TCP_PTR_ACK_NR], seq + length);
+        tcp_add_flags(TCP_FLAG_RESET | TCP_FLAG_ACK);
+    }
+    tcp_send(0);
+}
+
+uint8_t tcp_stream(void (*producer)(uint16_t ref, uint32_t offset, uint16_t length), uint16_t ref) {
+    tcp_connection_t *con = tcp_current;
+
+    if (con->stream) {
+        return 0;
+    }
+    con->stream = producer;
+    con->stream_ref = ref;
+    con->stream_start = con->snd_nxt;
+    con->stream_done = 0;
+
+    // Send the first segments
+    stream_send(con);
+    return 1;
+}
+
+// Send the segments of the stream which fit in the window of the peer
+void stream_send(tcp_connection_t *con) {
+    uint16_t length;
+    uint32_t next;
+
+    // Only while data may be sent
+    if (con->stream == 0 || con->stream_done) {
+        return;
+    }
+    if (con->state != TCP_STATE_ESTABLISHED && con->state != TCP_STATE_CLOSE_WAIT
+        && con->state != TCP_STATE_FIN_WAIT_1 && con->state != TCP_STATE_CLOSING
+        && con->state != TCP_STATE_LAST_ACK) {
+        return;
+    }
+    tcp_current = con;
+    next = con->snd_nxt;
+    while (1) {
+        // Room left in the window
+        if ((int32_t)(con->snd_una + con->snd_wnd - next) <= 0) {
+            break;
+        }
+        length = con->snd_una + con->snd_wnd - next;
+        if (length > con->mss) {
+            length = con->mss;
+        }
+#ifdef NET_TCP_RETRANSMIT
+        // The window is open again
+        con->probing = 0;
+#endif // NET_TCP_RETRANSMIT
+
+        // Let the producer append the segment
+        connection_construct(con);
+        tcp_add_flags(TCP_FLAG_ACK | TCP_FLAG_PUSH);
+        tcp_gather_begin();
+        con->stream(con->stream_ref, next - con->stream_start, length);
+        // A short segment ends the stream
+        if (network_tx_length() - ETH_LEN_HEADER - IP_LEN_HEADER - TCP_LEN_HEADER < length) {
+            tcp_add_flags(TCP_FLAG_ACK | TCP_FLAG_PUSH | TCP_FLAG_FIN);
+            con->stream_done = 1;
+        }
+        tcp_gather_send();
+
+        // Not sent while the next hop is resolved
+        if (con->snd_nxt == next) {
+            con->stream_done = 0;
+            break;
+        }
+        next = con->snd_nxt;
+        if (con->stream_done) {
+            break;
+        }
+    }
+#ifdef NET_TCP_RETRANSMIT
+    // Probe a closed window when nothing else waits for an acknowledgement,
+    // see RFC 1122, p. 92
+    if (!con->stream_done && con->snd_wnd == 0 && con->snd_una == con->snd_max && con->rto_left == 0) {
+        con->probing = 1;
+        con->rto_left = con->rto;
+    }
+#endif // NET_TCP_RETRANSMIT
+}
+
+// Handle an acknowledgement of new data in SND.UNA
+void segment_acked(tcp_connection_t *con) {
+    // Packets sent again before it are acknowledged already
+    if ((int32_t)(con->snd_una - con->snd_nxt) > 0) {
+        con->snd_nxt = con->snd_una;
+    }
+#ifdef NET_TCP_RETRANSMIT
+    // Measure the round trip of the timed packet
+    if (con->rtt_timing && (int32_t)(con->snd_una - con->rtt_seq) >= 0) {
+        con->rtt_timing = 0;
+        rtt_update(con, con->rtt_ticks);
+    }
+    con->retries = 0;
+    // Wait for the rest, see RFC 6298, p. 5
+    if (con->snd_una == con->snd_max) {
+        con->rto_left = 0;
+    } else {
+        con->rto_left = con->rto;
+    }
+#endif // NET_TCP_RETRANSMIT
+}
+
+#ifdef NET_TCP_RETRANSMIT
+// Update the retransmission timeout with a round trip time, see RFC 6298,
+// p. 2
+void rtt_update(tcp_connection_t *con, uint16_t rtt) {
+    int16_t delta;
+    uint16_t rto;
+
+    if (rtt > TCP_RTO_MAX) {
+        rtt = TCP_RTO_MAX;
+    }
+    if (con->srtt == 0) {
+        // First measurement: SRTT = R, RTTVAR = R / 2, the lowest bit
+        // marks SRTT as measured
+        con->srtt = (rtt << 3) | 1;
+        con->rttvar = rtt << 1;
+    } else {
+        // SRTT = 7/8 SRTT + 1/8 R
+        delta = rtt - (con->srtt >> 3);
+        con->srtt += delta;
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+        if (delta < 0) {
+            delta = -delta;
         }
+        con->rttvar += delta - (con->rttvar >> 2);
     }
-    // Other cases
-    else {
-        // Notify type
-        debug_string_p(PSTR("UNKNOWN: "));
-        debug_number_as_hex(type);
-        debug_newline();
+
+    // RTO = SRTT + 4 RTTVAR
+    rto = (con->srtt >> 3) + con->rttvar;
+    if (rto < TCP_RTO_MIN) {
+        rto = TCP_RTO_MIN;
+    } else if (rto > TCP_RTO_MAX) {
+        rto = TCP_RTO_MAX;
+    }
+    con->rto = rto;
+#ifdef UTILS_WERKTI_MORE
+    werkti_tcp_rto = (uint32_t)rto * 1000 / COUNTER_TICKS_PER_SECOND;
+#endif // UTILS_WERKTI_MORE
+}
+
+// Send the unacknowledged packets again from SND.UNA on
+void segment_resend(tcp_connection_t *con) {
+    tcp_current = con;
+    con->snd_nxt = con->snd_una;
+
+    switch (con->state) {
+        case TCP_STATE_SYN_SENT:
+        case TCP_STATE_SYN_RECEIVED:
+            // SYN, with ACK if it answers one
+            connection_construct(con);
+            tcp_add_flags(con->state == TCP_STATE_SYN_SENT ? TCP_FLAG_SYN : TCP_FLAG_SYN | TCP_FLAG_ACK);
+            add_syn_options();
+            tcp_send(0);
+            break;
+        default:
+            if (con->stream) {
+                // Generate the stream again
+                con->stream_done = 0;
+                stream_send(con);
+            } else if ((con->state == TCP_STATE_FIN_WAIT_1 || con->state == TCP_STATE_CLOSING
+                || con->state == TCP_STATE_LAST_ACK) && con->snd_una + 1 == con->snd_max) {
+                // Only the FIN is waiting for an acknowledgement
+                connection_construct(con);
+                tcp_add_flags(TCP_FLAG_FIN | TCP_FLAG_ACK);
+                tcp_send(0);
+            } else if (con->snd_una != con->snd_max) {
+                // Data of tcp_send is not kept, a FIN after it would leave a
+                // gap the peer never fills. Reset instead of letting it wait.
+                debug_string_p(PSTR("TCP: data lost\r\n"));
+                connection_construct(con);
+                tcp_add_flags(TCP_FLAG_RESET | TCP_FLAG_ACK);
+                tcp_send(0);
+                con->state = TCP_STATE_CLOSED;
+                con->rto_left = 0;
+            } else {
+                // Nothing to send again
+                con->snd_nxt = con->snd_max;
+                con->rto_left = 0;
+            }
+            break;
     }
+    tcp_current = 0;
+}
+#endif // NET_TCP_RETRANSMIT
+
+void tcp_poll(void) {
+#if defined(NET_TCP_ACK_DELAY) || defined(NET_TCP_RETRANSMIT) || defined(NET_TCP_IDLE_TIMEOUT)
+    uint8_t i = 0;
+    uint8_t elapsed;
+#ifdef NET_TCP_RETRANSMIT
+    uint8_t count;
+#endif // NET_TCP_RETRANSMIT
+#ifdef NET_TCP_IDLE_TIMEOUT
+    uint8_t busy;
+#endif // NET_TCP_IDLE_TIMEOUT
+    tcp_connection_t *con;
+
+    // Ticks since the last poll
+    elapsed = counter_ticks() - poll_ticks;
+    poll_ticks += elapsed;
+
+    while (i < NET_TCP_CONNECTIONS) {
+        con = &connections[i];
+        i++;
+        if (con->state == TCP_STATE_CLOSED) {
+            continue;
+        }
+#ifdef NET_TCP_RETRANSMIT
+        // Time the round trip
+        if (con->rtt_timing && con->rtt_ticks < TCP_RTO_MAX) {
+            con->rtt_ticks += elapsed;
+        }
+        // No acknowledgement in time
+        if (con->rto_left) {
+            if (con->rto_left > elapsed) {
+                con->rto_left -= elapsed;
+            } else {
+                // Give up, but a closed window may stay closed as long as the
+                // peer likes, see RFC 1122, p. 92
+                if (!con->probing && con->retries >= NET_TCP_RETRIES) {
+                    debug_string_p(PSTR("TCP: timed out\r\n"));
+                    con->state = TCP_STATE_CLOSED;
+                    continue;
+                }
+                // Do not time packets which are sent again, see RFC 6298, p. 5
+                con->rtt_timing = 0;
+                con->rto_left = con->rto;
+                count = tcp_sent;
+                if (con->probing) {
+                    // Send one byte beyond the window, the answer tells if it
+                    // opened
+                    con->snd_wnd = 1;
+                    segment_resend(con);
+                    con->snd_wnd = 0;
+                    con->rtt_timing = 0;
+                    con->probing = 1;
+                } else {
+                    segment_resend(con);
+                }
+                // Back off when packets went out, not while the next hop is
+                // resolved
+                if (count != tcp_sent) {
+                    if (!con->probing) {
+                        debug_string_p(PSTR("TCP: retransmit\r\n"));
+                        con->retries++;
+#ifdef UTILS_WERKTI_MORE
+                        werkti_tcp_retransmits++;
+#endif // UTILS_WERKTI_MORE
+                    }
+                    con->rto <<= 1;
+                    if (con->rto > TCP_RTO_MAX) {
+                        con->rto = TCP_RTO_MAX;
+                    }
+#ifdef UTILS_WERKTI_MORE
+                    werkti_tcp_rto = (uint32_t)con->rto * 1000 / COUNTER_TICKS_PER_SECOND;
+#endif // UTILS_WERKTI_MORE
+                    if (con->rto_left) {
+                        con->rto_left = con->rto;
+                    }
+                }
+                // Reset because the data could not be sent again
+                if (con->state == TCP_STATE_CLOSED) {
+                    continue;
+                }
+            }
+        }
+#endif // NET_TCP_RETRANSMIT
+#ifdef NET_TCP_IDLE_TIMEOUT
+        busy = 0;
+#ifdef NET_TCP_RETRANSMIT
+        // Packets waiting for an acknowledgement time out by NET_TCP_RETRIES
+        busy = (con->rto_left != 0 && !con->probing);
+#endif // NET_TCP_RETRANSMIT
+        // Nothing heard from the peer for too long
+        if (!busy && (uint16_t)(counter_seconds() - con->seen) >= NET_TCP_IDLE_TIMEOUT) {
+            debug_string_p(PSTR("TCP: idle\r\n"));
+            // Let the peer know, unless it closed already
+            if (con->state != TCP_STATE_SYN_SENT && con->state != TCP_STATE_TIME_WAIT) {
+                tcp_current = con;
+                connection_construct(con);
+                tcp_add_flags(TCP_FLAG_RESET | TCP_FLAG_ACK);
+                tcp_send(0);
+                tcp_current = 0;
+            }
+            con->state = TCP_STATE_CLOSED;
+            continue;
+        }
+#endif // NET_TCP_IDLE_TIMEOUT
+#ifdef NET_TCP_ACK_DELAY
+        // Waited long enough for a reply, two seconds also cover ticks which
+        // wrapped while tcp_poll was not called
+        if (con->ack_delayed && ((uint8_t)(counter_ticks() - con->ack_time) >= TCP_ACK_DELAY_TICKS
+            || (uint16_t)(counter_seconds() - con->ack_second) >= 2)) {
+            debug_string_p(PSTR("TCP: delayed ack\r\n"));
+            // ACK packet, buffer_in holds another packet
+            tcp_current = con;
+            connection_construct(con);
+            tcp_add_flags(TCP_FLAG_ACK);
+            tcp_send(0);
+            tcp_current = 0;
+        }
+#endif // NET_TCP_ACK_DELAY
+    }
+#endif // NET_TCP_ACK_DELAY || NET_TCP_RETRANSMIT || NET_TCP_IDLE_TIMEOUT
 }
 
 void tcp_port_register(uint16_t port, void (*callback)(uint8_t *data, uint16_t length)) {
@@ -257,7 +1147,7 @@ void tcp_port_unregister(uint16_t port) {
 }
 
 uint8_t *tcp_prepare_reply(void) {
-    // Prepare using construct method
+    // Prepare using construct method, the numbers come from the connection
     construct(
       // Source port
       (buffer_in[TCP_PTR_PORT_DST_H] << 8) | buffer_in[TCP_PTR_PORT_DST_L],
@@ -269,15 +1159,6 @@ uint8_t *tcp_prepare_reply(void) {
       &buffer_in[ETH_PTR_MAC_SRC]
     );
 
-    // Switch seq and ack
-    uint8_t i;
-    for(i = 0; i < 4; i++) {
-        buffer_out[TCP_PTR_SEQ_NR+i] = buffer_in[TCP_PTR_ACK_NR+i];
-    }
-    for(i=0; i<4; i++) {
-        buffer_out[TCP_PTR_ACK_NR+i] = buffer_in[TCP_PTR_SEQ_NR+i];
-    }
-
     return &buffer_out[TCP_PTR_DATA];
 }
 
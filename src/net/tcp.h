@@ -31,19 +31,125 @@
 
 #define tcp_add_flags(x) buffer_out[TCP_PTR_FLAGS] = x
 
+// Connection states, see RFC 793, p. 21
+#define TCP_STATE_CLOSED       0
+#define TCP_STATE_SYN_SENT     1
+#define TCP_STATE_SYN_RECEIVED 2
+#define TCP_STATE_ESTABLISHED  3
+#define TCP_STATE_FIN_WAIT_1   4
+#define TCP_STATE_FIN_WAIT_2   5
+#define TCP_STATE_CLOSE_WAIT   6
+#define TCP_STATE_CLOSING      7
+#define TCP_STATE_LAST_ACK     8
+#define TCP_STATE_TIME_WAIT    9
+
+// Options, see RFC 793, p. 18
+#define TCP_OPT_END        0
+#define TCP_OPT_NOP        1
+#define TCP_OPT_MSS        2
+#define TCP_OPT_MSS_LENGTH 4
+
+// Largest segment which fits in buffer_in, the chip stores the CRC as well
+#define TCP_MSS_RECEIVE (BUFFER_IN_SIZE - 4 - ETH_LEN_HEADER - IP_LEN_HEADER - TCP_LEN_HEADER)
+// Largest segment which fits in buffer_out
+#define TCP_MSS_SEND (BUFFER_OUT_SIZE - ETH_LEN_HEADER - IP_LEN_HEADER - TCP_LEN_HEADER)
+// Segment size when the peer does not send its own, see RFC 879
+#define TCP_MSS_DEFAULT 536
+
 /**
- * @brief Prepare the headers (ethernet, ip, tcp) for a packet.
+ * @brief Transmission control block of a connection
  *
- * Add data at the returned pointer and send the packet by using
- * tcp_send(length).
+ * A closed connection has state TCP_STATE_CLOSED, ports which have a service
+ * are listening.
+ */
+typedef struct {
+    // Address and port of the peer
+    uint8_t ip[4];
+    uint16_t remote_port;
+    // MAC address of the peer or the next hop to it, all zero to route
+    // (NET_ARP)
+    uint8_t mac[6];
+    // Own port
+    uint16_t local_port;
+    // Oldest sequence number not acknowledged by the peer (SND.UNA)
+    uint32_t snd_una;
+    // Next sequence number to send (SND.NXT)
+    uint32_t snd_nxt;
+    // Highest sequence number sent, SND.NXT goes back on a retransmission
+    uint32_t snd_max;
+    // Next sequence number expected from the peer (RCV.NXT)
+    uint32_t rcv_nxt;
+    // Largest segment to send, the MSS of the peer clamped to TCP_MSS_SEND
+    uint16_t mss;
+    // Window advertised by the peer (SND.WND)
+    uint16_t snd_wnd;
+    // Producer of the stream sent with tcp_stream(), zero if none
+    void (*stream)(uint16_t ref, uint32_t offset, uint16_t length);
+    // Value passed to the producer
+    uint16_t stream_ref;
+    // Sequence number of the first byte of the stream
+    uint32_t stream_start;
+    // Is the end of the stream sent?
+    uint8_t stream_done;
+#ifdef NET_TCP_RETRANSMIT
+    // Smoothed round trip time x8 and its variation x4 in counter ticks, see
+    // RFC 6298
+    uint16_t srtt;
+    uint16_t rttvar;
+    // Retransmission timeout and the ticks left before it expires, zero when
+    // nothing is waiting for an acknowledgement
+    uint16_t rto;
+    uint16_t rto_left;
+    // Ticks since the timed packet was sent and the acknowledgement it
+    // waits for
+    uint16_t rtt_ticks;
+    uint32_t rtt_seq;
+    // Is a packet timed?
+    uint8_t rtt_timing;
+    // Retransmissions since the last acknowledgement
+    uint8_t retries;
+    // Does the timer probe a closed window?
+    uint8_t probing;
+#endif // NET_TCP_RETRANSMIT
+#ifdef NET_TCP_ACK_DELAY
+    // Is RCV.NXT not acknowledged yet, since which counter tick and second,
+    // the second catches a tick count which wrapped
+    uint8_t ack_delayed;
+    uint8_t ack_time;
+    uint16_t ack_second;
+#endif // NET_TCP_ACK_DELAY
+#ifdef NET_TCP_IDLE_TIMEOUT
+    // Second of the last packet from the peer
+    uint16_t seen;
+#endif // NET_TCP_IDLE_TIMEOUT
+    // TCP_STATE_*
+    uint8_t state;
+} tcp_connection_t;
+
+/**
+ * @brief Connection of the packet being handled or prepared, zero if none
+ *
+ * Packets prepared with tcp_prepare_reply() take their sequence and
+ * acknowledgement number from this connection. Sending them updates it.
+ */
+extern tcp_connection_t *tcp_current;
+
+/**
+ * @brief Open a connection and prepare the headers (ethernet, ip, tcp) of its
+ * SYN packet.
+ *
+ * Send the packet by using tcp_send(0). The connection is looked up in a table
+ * of NET_TCP_CONNECTIONS entries by address and ports.
  *
  * @param port_source Port which the packet is send from
  * @param ip_destination IP address the packet is send to
  * @param port_destination Port which the packet is send to
- * @param mac_destination MAC address the packet is send to
- * @return Pointer to the start of the data block to write to
+ * @param mac_destination MAC address the packet is send to, zero to route
+ * (NET_ARP)
+ * @return Pointer to the start of the data block to write to, zero when there
+ * is no free connection
  */
-extern uint8_t *tcp_prepare();
+extern uint8_t *tcp_prepare(uint16_t port_source, uint8_t *ip_destination, uint16_t port_destination, uint8_t *mac_destination);
 
 /**
  * @brief Send a prepared packet of the provided length.
@@ -53,13 +159,59 @@ extern uint8_t *tcp_prepare();
  * calculated. Afterwards the packet will be transfered to the network chip and
  * transmitted.
  *
+ * @note The data is not kept. With NET_TCP_RETRANSMIT a lost SYN or FIN is
+ * sent again, but lost data resets the connection. Use tcp_stream() for data
+ * which should be sent again.
  * @param length Length of the data block
  */
-extern void tcp_send();
+extern void tcp_send(uint16_t length);
+
+/**
+ * @brief Start gathering the data of a prepared packet in the network chip
+ *
+ * Call after tcp_prepare or tcp_prepare_reply, append the data with the
+ * network_tx_append functions and send the packet with tcp_gather_send(). The
+ * headers in buffer_out can still be changed until it is sent.
+ */
+extern void tcp_gather_begin(void);
+
+/**
+ * @brief Send a packet gathered after tcp_gather_begin()
+ *
+ * The length in the headers (ip) will be set to the gathered data and
+ * checksums calculated, the headers are written to the network chip and the
+ * packet is transmitted. Like with tcp_send() the data is not kept.
+ *
+ * The gathered data can not be kept while the next hop is resolved (NET_ARP),
+ * the packet is dropped then. A stream is produced again by the retransmission
+ * timer. A reply of a service is not acknowledged, the peer sends the request
+ * again.
+ *
+ * @return 1 if the packet is sent, 0 if it is dropped
+ */
+extern uint8_t tcp_gather_send(void);
 
 // Do we want TCP server?
 #ifdef NET_TCP_SERVER
 
+/**
+ * @brief Send a stream of data on the connection of the received packet
+ *
+ * Call from a service before it sends anything. The stream is sent in
+ * segments as far as the window of the peer allows, more segments follow when
+ * they are acknowledged. The data is not kept, <i>producer</i> is called for
+ * every segment with the offset in the stream and the length of the segment.
+ * It appends that part of the stream with the network_tx_append functions and
+ * should append the same data when it is called for the same offset again.
+ * Appending less than <i>length</i> ends the stream and closes the
+ * connection.
+ *
+ * @param producer Function which appends the data of a segment
+ * @param ref Value passed to <i>producer</i>
+ * @return 1 if the stream started, 0 if the connection already has a stream
+ */
+extern uint8_t tcp_stream(void (*producer)(uint16_t ref, uint32_t offset, uint16_t length), uint16_t ref);
+
 /**
  * @brief Initialize the TCP server.
  *
@@ -71,12 +223,23 @@ extern void tcp_server_init(void);
 /**
  * @brief Handle received TCP packets.
  *
- * Looks up in the port service table if the packet was send to a port which has
- * a service attached. If so, the service will be called and given a pointer to
- * the start of the data and the length of the data.
+ * Packets are checked against the state of their connection. A SYN to a port
+ * which has a service attached opens a connection, other packets without a
+ * connection are answered with a reset. Data received in order is handed to
+ * the service with a pointer to the start of the data and the length of the
+ * data. A reply of the service acknowledges the data, otherwise an ACK is
+ * sent after NET_TCP_ACK_DELAY.
  */
 extern void tcp_receive(void);
 
+/**
+ * @brief Send the acknowledgements which were delayed too long and packets
+ * which were not acknowledged in time, drop idle connections
+ *
+ * @note Should not be called by users, it is called by network_backbone.
+ */
+extern void tcp_poll(void);
+
 /**
  * @brief Register a service to a port.
  *
@@ -95,7 +258,8 @@ extern void tcp_port_unregister(uint16_t port);
 /**
  * @brief Create an TCP reply template from a received TCP packet.
  *
- * Returns the pointer to the start of the data block. <br />
+ * Returns the pointer to the start of the data block. The sequence and
+ * acknowledgement number are taken from tcp_current. <br />
  *
  * @note Use tcp_send(length) to send the packet.
  * @return Pointer to the start of the data block
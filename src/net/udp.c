@@ -25,7 +25,7 @@
 #error NET_UDP_SERVICES_LIST_SIZE not defined, but NET_UDP_SERVER active
 #endif // NET_UDP_SERVICES_LIST_SIZE
 // Create port service list
-port_service_t port_services[NET_UDP_SERVICES_LIST_SIZE];
+static port_service_t port_services[NET_UDP_SERVICES_LIST_SIZE];
 #endif // NET_UDP_SERVER
 
 uint8_t *udp_prepare(uint16_t src_port, uint8_t *dst_ip, uint16_t dst_port, uint8_t *dst_mac) {
@@ -68,18 +68,142 @@ void udp_send(uint16_t length) {
     buffer_out[IP_PTR_CHECKSUM_H] = tmp >> 8;
     buffer_out[IP_PTR_CHECKSUM_L] = tmp & 0xFF;
 
+#ifdef UTILS_WERKTI_MORE
+    // Update werkti udp out
+    werkti_udp_out += ETH_LEN_HEADER + IP_LEN_HEADER + UDP_LEN_HEADER + length;
+#endif // UTILS_WERKTI_MORE
+
+#ifdef NET_NETWORK_CHECKSUM_OFFLOAD
+    // Send packet to chip, let the chip calculate the UDP checksum
+#ifdef NET_ARP
+    // A packet waiting for its next hop is kept in memory instead
+    if (ip_resolved())
+#endif // NET_ARP
+    {
+        checksum_offload_send(ETH_LEN_HEADER + IP_LEN_HEADER + UDP_LEN_HEADER + length, CHK_UDP);
+        return;
+    }
+#endif // NET_NETWORK_CHECKSUM_OFFLOAD
     // Calculate checksum UDP data
     tmp = checksum(&buffer_out[IP_PTR_SRC], 16 + length, CHK_UDP);
     buffer_out[UDP_PTR_CHECKSUM_H] = tmp >> 8;
     buffer_out[UDP_PTR_CHECKSUM_L] = tmp & 0xFF;
 
+    // Send packet
+    ip_send(ETH_LEN_HEADER + IP_LEN_HEADER + UDP_LEN_HEADER + length);
+}
+
+#if UDP_FLOW_HEADER_SIZE != UDP_PTR_DATA
+#error UDP_FLOW_HEADER_SIZE should equal UDP_PTR_DATA
+#endif
+
+void udp_flow_init(udp_flow_t *flow, uint16_t src_port, uint8_t *dst_ip, uint16_t dst_port, uint8_t *dst_mac) {
+    uint8_t i = 0;
+
+    // Prepare a packet the usual way
+    udp_prepare(src_port, dst_ip, dst_port, dst_mac);
+
+    // Keep the headers, without the fields which change per packet
+    while (i < UDP_PTR_DATA) {
+        flow->header[i] = buffer_out[i];
+        i++;
+    }
+    flow->header[IP_PTR_LENGTH_H] = 0;
+    flow->header[IP_PTR_LENGTH_L] = 0;
+    flow->header[IP_PTR_ID_L] = 0;
+    flow->header[UDP_PTR_LENGTH_H] = 0;
+    flow->header[UDP_PTR_LENGTH_L] = 0;
+
+    // Sum the constant part of the headers
+    flow->ip_sum = checksum_add(0, &flow->header[IP_PTR], IP_LEN_HEADER);
+    flow->udp_sum = checksum_add(IP_VAL_PROTO_UDP, &flow->header[IP_PTR_SRC], 8 + UDP_LEN_HEADER);
+
+    flow->routed = (dst_mac == 0);
+#ifdef NET_ARP
+    // An unresolved MAC address is looked up again on the next packet
+    flow->ready = ip_resolved();
+    flow->generation = arp_generation;
+    flow->slot = flow->routed ? ip_route_slot : NET_ARP_CACHE_SIZE;
+#else
+    flow->ready = 1;
+#endif // NET_ARP
+}
+
+uint8_t *udp_flow_prepare(udp_flow_t *flow) {
+    uint8_t i = 0;
+
+#ifdef NET_ARP
+    // Build the template again when the next hop could have changed
+    if (!flow->ready || (flow->routed && flow->generation != arp_generation)) {
+        udp_flow_init(flow,
+            ((uint16_t)flow->header[UDP_PTR_PORT_SRC_H] << 8) | flow->header[UDP_PTR_PORT_SRC_L],
+            &flow->header[IP_PTR_DST],
+            ((uint16_t)flow->header[UDP_PTR_PORT_DST_H] << 8) | flow->header[UDP_PTR_PORT_DST_L],
+            flow->routed ? 0 : &flow->header[ETH_PTR_MAC_DST]);
+        // Send the prepared packet, it waits for the MAC address when needed
+        return &buffer_out[UDP_PTR_DATA];
+    }
+    // Keep the next hop in the ARP cache while the flow sends to it
+    if (flow->slot < NET_ARP_CACHE_SIZE) {
+        arp_cache_use(flow->slot);
+    }
+    // The template has the MAC address, ip_prepare() is not called
+    ip_discard();
+#endif // NET_ARP
+
+    // Copy the headers
+    while (i < UDP_PTR_DATA) {
+        buffer_out[i] = flow->header[i];
+        i++;
+    }
+    buffer_out[IP_PTR_ID_L] = id_nr;
+    id_nr++;
+
+    // Return pointer to the data block
+    return &buffer_out[UDP_PTR_DATA];
+}
+
+void udp_flow_send(udp_flow_t *flow, uint16_t length) {
+    uint32_t sum;
+    uint16_t tmp;
+
+    // IP protocol packet length
+    tmp = IP_LEN_HEADER + UDP_LEN_HEADER + length;
+    buffer_out[IP_PTR_LENGTH_H] = tmp >> 8;
+    buffer_out[IP_PTR_LENGTH_L] = tmp & 0xFF;
+
+    // IP header checksum: add length and identification to the template sum
+    sum = (uint32_t)flow->ip_sum + tmp + buffer_out[IP_PTR_ID_L];
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    tmp = ~sum;
+    buffer_out[IP_PTR_CHECKSUM_H] = tmp >> 8;
+    buffer_out[IP_PTR_CHECKSUM_L] = tmp & 0xFF;
+
+    // UDP protocol packet length
+    tmp = UDP_LEN_HEADER + length;
+    buffer_out[UDP_PTR_LENGTH_H] = tmp >> 8;
+    buffer_out[UDP_PTR_LENGTH_L] = tmp & 0xFF;
+
+    // UDP checksum: add the length, in pseudo and UDP header, and the data
+    sum = (uint32_t)flow->udp_sum + tmp + tmp;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    tmp = ~checksum_add(sum, &buffer_out[UDP_PTR_DATA], length);
+    // A calculated checksum of zero is transmitted as all ones
+    if (tmp == 0) {
+        tmp = 0xFFFF;
+    }
+    buffer_out[UDP_PTR_CHECKSUM_H] = tmp >> 8;
+    buffer_out[UDP_PTR_CHECKSUM_L] = tmp & 0xFF;
+
 #ifdef UTILS_WERKTI_MORE
     // Update werkti udp out
     werkti_udp_out += ETH_LEN_HEADER + IP_LEN_HEADER + UDP_LEN_HEADER + length;
 #endif // UTILS_WERKTI_MORE
 
-    // Send packet to chip
-    network_send(ETH_LEN_HEADER + IP_LEN_HEADER + UDP_LEN_HEADER + length);
+    // Send packet
+    ip_send(ETH_LEN_HEADER + IP_LEN_HEADER + UDP_LEN_HEADER + length);
 }
 
 #ifdef NET_UDP_SERVER
@@ -114,6 +238,8 @@ void udp_receive(void) {
     debug_string_p(PSTR("done\r\n"));
     if (callback) {
         debug_string_p(PSTR("UDP: Found callback function\r\n"));
+        // Load the data of the packet
+        network_fetch();
         uint16_t length = ((uint16_t)buffer_in[IP_PTR_LENGTH_H]) << 8;
         length |= buffer_in[IP_PTR_LENGTH_L];
         length -= IP_LEN_HEADER + UDP_LEN_HEADER;
@@ -133,19 +259,24 @@ void udp_port_unregister(uint16_t port) {
 }
 
 uint8_t *udp_prepare_reply(void) {
+    uint8_t port_h, port_l;
+
     // Create IP header
-    // Create IP protocol header
+    // Create IP protocol header, the addresses can be swapped in place
     ip_prepare(IP_VAL_PROTO_UDP, &buffer_in[IP_PTR_SRC], &buffer_in[ETH_PTR_MAC_SRC]);
 
     // Construct UDP protocol header
     // -----------------------------
     // See RFC 768, p. 1
+    // Swap the ports, buffer_out can be buffer_in
+    port_h = buffer_in[UDP_PTR_PORT_SRC_H];
+    port_l = buffer_in[UDP_PTR_PORT_SRC_L];
     // Source port
     buffer_out[UDP_PTR_PORT_SRC_H] = buffer_in[UDP_PTR_PORT_DST_H];
     buffer_out[UDP_PTR_PORT_SRC_L] = buffer_in[UDP_PTR_PORT_DST_L];
     // Destination port
-    buffer_out[UDP_PTR_PORT_DST_H] = buffer_in[UDP_PTR_PORT_SRC_H];
-    buffer_out[UDP_PTR_PORT_DST_L] = buffer_in[UDP_PTR_PORT_SRC_L];
+    buffer_out[UDP_PTR_PORT_DST_H] = port_h;
+    buffer_out[UDP_PTR_PORT_DST_L] = port_l;
     // Length: ignore, set correctly in updClientSend
     // Checksum: 0, set correctly in udpClientSend
     buffer_out[UDP_PTR_CHECKSUM_H] = 0;
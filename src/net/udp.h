@@ -55,6 +55,67 @@ extern uint8_t *udp_prepare(uint16_t port_source, uint8_t *ip_destination, uint1
  */
 extern void udp_send(uint16_t length);
 
+/**
+ * @brief Length of the ethernet, IP and UDP header, equals UDP_PTR_DATA
+ */
+#define UDP_FLOW_HEADER_SIZE 42
+
+/**
+ * @brief Header template of a flow of packets to the same destination
+ *
+ * @see udp_flow_init(udp_flow_t*, uint16_t, uint8_t*, uint16_t, uint8_t*)
+ */
+typedef struct {
+    // Ethernet, IP and UDP header without lengths, identification and checksums
+    uint8_t header[UDP_FLOW_HEADER_SIZE];
+    // Sum of the IP header
+    uint16_t ip_sum;
+    // Sum of the pseudo header and UDP header
+    uint16_t udp_sum;
+    // Is the header complete?
+    uint8_t ready;
+    // Is the destination MAC address found by ip_route()?
+    uint8_t routed;
+    // ARP cache generation and slot of a routed MAC address, the slot is
+    // NET_ARP_CACHE_SIZE when the address is not cached
+    uint8_t generation;
+    uint8_t slot;
+} udp_flow_t;
+
+/**
+ * @brief Prepare a header template for packets to the same destination
+ *
+ * Packets of a flow are prepared by copying the template, only the lengths,
+ * identification and checksums are filled in when sending. Prepares a packet
+ * in buffer_out to build the template.
+ *
+ * @param flow Template to prepare
+ * @param port_source Port which the packets are send from
+ * @param ip_destination IP address the packets are send to
+ * @param port_destination Port which the packets are send to
+ * @param mac_destination MAC address the packets are send to, zero to route
+ * (NET_ARP)
+ */
+extern void udp_flow_init(udp_flow_t *flow, uint16_t port_source, uint8_t *ip_destination, uint16_t port_destination, uint8_t *mac_destination);
+
+/**
+ * @brief Prepare the headers of a packet of a flow
+ *
+ * The template is built again when the routed MAC address could have changed.
+ *
+ * @param flow Template prepared by udp_flow_init()
+ * @return Pointer to the start of the data block to write to
+ */
+extern uint8_t *udp_flow_prepare(udp_flow_t *flow);
+
+/**
+ * @brief Send a packet prepared by udp_flow_prepare() of the provided length
+ *
+ * @param flow Template used to prepare the packet
+ * @param length Length of the data block
+ */
+extern void udp_flow_send(udp_flow_t *flow, uint16_t length);
+
 // Do we want UDP server?
 #ifdef NET_UDP_SERVER
 
@@ -52,8 +52,10 @@ int main(void) {
 
     // Initialize www server
     www_server_init();
-    www_server_register_path(PSTR("/"), www_root);
-    www_server_register_path(PSTR("/status"), www_status);
+    // The replies are the same every time, stream them so lost packets are
+    // sent again
+    www_server_register_stream(PSTR("/"), www_root);
+    www_server_register_stream(PSTR("/status"), www_status);
 
     // Infinite loop
     while (1) {
@@ -61,6 +63,10 @@ int main(void) {
         network_backbone();
         // Maybe send werkti report
         werkti_maybe_report();
+#ifdef NET_NETWORK_INTERRUPT
+        // Sleep until the next packet or timer tick
+        network_idle();
+#endif // NET_NETWORK_INTERRUPT
     }
 
 }
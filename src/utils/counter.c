@@ -25,12 +25,22 @@
 // Counter which shows how far in a second we are
 volatile uint8_t sub_seconds;
 volatile uint8_t is_running;
+// Seconds since the counter started
+volatile uint16_t seconds;
+// Timer interrupts since the counter started
+volatile uint8_t ticks;
 
 void tick(void) {
+    // Update seconds
+    seconds++;
 #ifdef NET_DHCP
     // Update dhcp counter
     dhcp_seconds++;
 #endif
+#ifdef NET_ARP
+    // Update arp request timers
+    arp_tick();
+#endif // NET_ARP
 #ifdef UTILS_UPTIME
     // Update uptime counter
     uptime_tick();
@@ -41,6 +51,21 @@ void tick(void) {
 #endif // UTILS_WERKTI || UTILS_WERKTI_MORE
 }
 
+uint16_t counter_seconds(void) {
+    uint16_t value;
+    uint8_t sreg = SREG;
+
+    // Read both bytes without the interrupt in between
+    cli();
+    value = seconds;
+    SREG = sreg;
+    return value;
+}
+
+uint8_t counter_ticks(void) {
+    return ticks;
+}
+
 uint8_t counter_is_running(void) {
     return is_running;
 }
@@ -66,6 +91,7 @@ void counter_init(void) {
 }
 
 ISR(TIMER0_COMPA_vect) {
+    ticks++;
     sub_seconds++;
     if (sub_seconds >= 89) {
         // A second passed
@@ -77,13 +103,14 @@ ISR(TIMER0_COMPA_vect) {
 #elif defined(UTILS_COUNTER_TIMER1)
 void counter_init(void) {
     // 16 bit timer
-    // 20 Mhz, prescaler 1024, compare match on 0x4C4A
+    // 20 Mhz, prescaler 64, compare match on 3124
+    // Count to 100 for a second
 
-    // CTC operation, OC1A and OC1B disconnected, prescaler 1024
+    // CTC operation, OC1A and OC1B disconnected, prescaler 64
     TCCR1A = 0x00;
-    TCCR1B = (1 << WGM12) | (1 << CS10) | (1 << CS12);
+    TCCR1B = (1 << WGM12) | (1 << CS10) | (1 << CS11);
     // Compare match value
-    OCR1A = 0x4C48;
+    OCR1A = 3124;
     // Set compare interrupt
     TIMSK1 = (1 << OCIE1A);
     // Set timer is running
@@ -91,7 +118,13 @@ void counter_init(void) {
 }
 
 ISR(TIMER1_COMPA_vect) {
-    tick();
+    ticks++;
+    sub_seconds++;
+    if (sub_seconds >= 100) {
+        // A second passed
+        tick();
+        sub_seconds = 0;
+    }
 }
 
 #elif defined(UTILS_COUNTER_TIMER2)
@@ -114,6 +147,7 @@ void counter_init(void) {
 }
 
 ISR(TIMER2_COMPA_vect) {
+    ticks++;
     sub_seconds++;
     if (sub_seconds >= 89) {
         // A second passed
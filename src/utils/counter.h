@@ -25,8 +25,18 @@
 #include <avr/interrupt.h>
 #include "uptime.h"
 #include "werkti.h"
+#include "../net/arp.h"
 #include "../net/dhcp.h"
 
+/**
+ * @brief Number of counter_ticks() in a second
+ */
+#ifdef UTILS_COUNTER_TIMER1
+#define COUNTER_TICKS_PER_SECOND 100
+#else
+#define COUNTER_TICKS_PER_SECOND 89
+#endif // UTILS_COUNTER_TIMER1
+
 /**
  * @brief Initialize the selected timer for counting
  */
@@ -37,5 +47,20 @@ extern void counter_init(void);
  */
 extern uint8_t counter_is_running(void);
 
+/**
+ * @brief Returns the seconds since the counter started
+ *
+ * The value wraps after about 18 hours, use differences for timing.
+ */
+extern uint16_t counter_seconds(void);
+
+/**
+ * @brief Returns the timer interrupts since the counter started
+ *
+ * There are COUNTER_TICKS_PER_SECOND ticks in a second. The value wraps after
+ * about 2.5 seconds, use differences for timing.
+ */
+extern uint8_t counter_ticks(void);
+
 #endif // UTILS_COUNTER
 #endif // UTILS_COUNTER_H
@@ -22,6 +22,11 @@
 #error Werkti cannot work without NET_UDP
 #endif // NET_UDP
 
+// Check if ARP is enabled to route the reports
+#if !defined(NET_ARP) && !defined(WERKTI_REMOTE_MAC)
+#error Werkti cannot route reports without NET_ARP, define WERKTI_REMOTE_MAC
+#endif // !NET_ARP && !WERKTI_REMOTE_MAC
+
 // Only build if requirements are met
 #if defined(NET_UDP)
 
@@ -32,12 +37,25 @@
 #define WERKTI_TYPE_ICMP 3
 #define WERKTI_TYPE_UDP  4
 #define WERKTI_TYPE_TCP  5
+#define WERKTI_TYPE_TCP_RTO 6
+
+// MAC address of the reports, zero to route them
+#ifdef WERKTI_REMOTE_MAC
+#define WERKTI_MAC werkti_remote_mac
+#else
+#define WERKTI_MAC 0
+#endif // WERKTI_REMOTE_MAC
 
 // Variables
 // --------------------------------------------------------------------
 
+#ifdef WERKTI_REMOTE_MAC
 uint8_t  werkti_remote_mac[6] = { WERKTI_REMOTE_MAC };
+#endif // WERKTI_REMOTE_MAC
 uint8_t  werkti_remote_ip[4] = { WERKTI_REMOTE_IP };
+// Header template of the reports
+udp_flow_t werkti_flow;
+uint8_t werkti_flow_made = 0;
 uint16_t werkti_in;
 uint16_t werkti_out;
 volatile uint16_t time;
@@ -50,6 +68,8 @@ uint16_t werkti_udp_in;
 uint16_t werkti_udp_out;
 uint16_t werkti_tcp_in;
 uint16_t werkti_tcp_out;
+uint16_t werkti_tcp_retransmits;
+uint16_t werkti_tcp_rto;
 #endif // UTILS_WERKTI_MORE
 
 // Functions
@@ -111,6 +131,12 @@ void werkti_maybe_report(void) {
         werkti_tcp_in = 0;
         werkti_tcp_out = 0;
 
+        // TCP retransmissions
+        // Send report, retransmissions as in and timeout as out
+        send_report(WERKTI_TYPE_TCP_RTO, werkti_tcp_retransmits, werkti_tcp_rto);
+        // Reset variable, the timeout is kept
+        werkti_tcp_retransmits = 0;
+
 #endif // UTILS_WERKTI_MORE
 
         // Debug: output bytes received and send
@@ -123,8 +149,12 @@ void werkti_maybe_report(void) {
 void send_report(uint8_t type, uint16_t in, uint16_t out) {
     uint8_t i = 0;
 
-    // Create UDP header
-    uint8_t *buf = udp_prepare(0, werkti_remote_ip, WERKTI_REMOTE_PORT, werkti_remote_mac);
+    // Create UDP header from the template, made on the first report
+    if (!werkti_flow_made) {
+        udp_flow_init(&werkti_flow, 0, werkti_remote_ip, WERKTI_REMOTE_PORT, WERKTI_MAC);
+        werkti_flow_made = 1;
+    }
+    uint8_t *buf = udp_flow_prepare(&werkti_flow);
 
     // Add MAC address
     while (i < 6) {
@@ -141,7 +171,7 @@ void send_report(uint8_t type, uint16_t in, uint16_t out) {
     buf[9] = out >> 8;
     buf[10] = out & 0xFF;
 
-    udp_send(11);
+    udp_flow_send(&werkti_flow, 11);
 }
 
 #endif // NET_UDP
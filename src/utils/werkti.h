@@ -86,6 +86,16 @@ extern uint16_t werkti_tcp_in;
  */
 extern uint16_t werkti_tcp_out;
 
+/**
+ * @brief TCP packets sent again
+ */
+extern uint16_t werkti_tcp_retransmits;
+
+/**
+ * @brief Last TCP retransmission timeout in milliseconds
+ */
+extern uint16_t werkti_tcp_rto;
+
 #endif // UTILS_WERKTI_MORE
 #endif // UTILS_WERKTI || UTILS_WERKTI_MORE
 #endif // UTILS_WERKTI_H